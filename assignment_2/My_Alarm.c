@@ -11,39 +11,1092 @@
  A modification of alarm_mutex.c that uses two extra parallel
  threads to manage odd and even requests, thus dividing the work. 
  Alarms are managed on an expiration basis.  
+ 
+ Under load more display threads are added, and requests are
+ spread over them by request number; they are removed again
+ when idle.
+ 
+ Run with "-p" to pin the alarm and display threads to cores of
+ a single NUMA node. "-m <count> [<distinct>]" only measures the
+ memory taken by <count> pending alarms and exits.
+ 
+ "Priority(<class>) <seconds> <message>" gives an alarm a priority
+ class, 0 being the most urgent.
+ 
+ "-l <pending>" and "-b <backlog>" limit how many alarms may be
+ pending, and how many may be waiting for the alarm thread, before
+ main stops admitting new ones; "-a block|reject|shed" picks what
+ happens then (see admit).
+ 
+ "-q <count>" measures submission latency with nothing due and with
+ <count> due alarms flooding the output, instead of reading commands.
+ 
+ "-t <file>" records what every thread does -- lock waits, ring and
+ shard handoffs, yields and expiries -- and writes it to <file> at
+ exit as a Chrome trace (load it in chrome://tracing or Perfetto).
  */
  
  
+#define _GNU_SOURCE /* for thread affinity */
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include "errors.h"
+#include "placement.h"
 #include <stdint.h>
+#include <stdatomic.h>
 //#define DEBUG
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * The "alarm" structure is kept small so that millions of pending
+ * alarms fit in memory. Times are seconds after time_base instead
+ * of a full time_t, and the message is an index into the table of
+ * interned messages, since the same text tends to be submitted over
+ * and over; the message index shares a word with the priority
+ * class. Each alarm is one 24-byte alarm_t that is carried through
+ * the ring, alarm_list and a shard list without being copied.
+ *
+ * Ownership of a node moves with it, and only its owner may touch
+ * it: main from alarm_alloc until stage_push, then the alarm thread
+ * while it is on alarm_list, then the shard (under the shard mutex)
+ * from shard_insert until the display thread unlinks it and hands it
+ * back with alarm_free. The link field is reused at every step.
  */
 typedef struct alarm_tag {
     struct alarm_tag    *link;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    char                message[64];
-	int 				request_num ;
+    int32_t             time;       /* seconds after time_base */
+    uint32_t            request_num;
+    uint32_t            message : 24;   /* index in the message table */
+    uint32_t            priority : 8;   /* class, 0 is most urgent */
+    int32_t             seconds;
 } alarm_t;
-/* one mutex for each list because they may be accessed at different 
-times. This way is faster and more efficient */
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t even_alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t odd_alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-alarm_t *alarm_list = NULL; /*intermediate storage for new alarm requests */
-alarm_t *even_alarm_list = NULL; /*even numbered requests */
-alarm_t *odd_alarm_list = NULL; /* odd numbered requests */
+/*
+ * Priority classes. "Priority(<class>) <seconds> <message>" submits
+ * an alarm in the given class; 0 is the most urgent, and alarms
+ * without a class are PRIORITY_NORMAL. Each class has its own ring,
+ * its own alarm_list and its own list on every shard, and at each
+ * step the alarm thread and the display threads serve the most
+ * urgent class that has work, so a burst of bulk alarms can't hold
+ * up an urgent one that is due at the same time.
+ */
+#define PRIORITY_CLASSES	3
+#define PRIORITY_NORMAL		1
+
+/*
+ * Expiry lateness per class, in milliseconds after the deadline,
+ * updated by the display threads.
+ */
+atomic_ulong fired_count[PRIORITY_CLASSES];
+atomic_ulong late_total[PRIORITY_CLASSES];
+atomic_ulong late_max[PRIORITY_CLASSES];
+
+time_t time_base; /* set once at startup */
+
+/*
+ * Current time in seconds after time_base.
+ */
+int clock_rel (void)
+{
+	return (int)(time (NULL) - time_base);
+}
+
+/*
+ * Alarms come from a slab, CHUNK_ALARMS at a time, instead of one
+ * malloc each, so there is no per-alarm allocator overhead. Expired
+ * alarms go back on a lock-free stack. Display threads push onto it
+ * and only main pops, so a pop can't be confused by the head being
+ * popped and pushed back in the meantime.
+ */
+#define CHUNK_ALARMS 65536
+
+alarm_t *_Atomic free_alarms = NULL;
+alarm_t *slab_next = NULL, *slab_end = NULL; /* main only */
+size_t slab_bytes = 0;
+atomic_ulong pending_alarms = 0;
+
+alarm_t *alarm_alloc (void)
+{
+	alarm_t *alarm;
+
+	alarm = atomic_load_explicit(&free_alarms, memory_order_acquire);
+	while (alarm != NULL
+		&& !atomic_compare_exchange_weak_explicit(&free_alarms, &alarm, alarm->link,
+			memory_order_acquire, memory_order_acquire))
+		;
+	if (alarm == NULL) {
+		if (slab_next == slab_end) {
+			slab_next = (alarm_t*)malloc (CHUNK_ALARMS * sizeof (alarm_t));
+			if (slab_next == NULL)
+				errno_abort ("Allocate alarm slab");
+			slab_end = slab_next + CHUNK_ALARMS;
+			slab_bytes += CHUNK_ALARMS * sizeof (alarm_t);
+		}
+		alarm = slab_next++;
+	}
+	atomic_fetch_add_explicit(&pending_alarms, 1, memory_order_relaxed);
+	return alarm;
+}
+
+void message_release (uint32_t message);
+
+void alarm_free (alarm_t *alarm)
+{
+	alarm_t *head;
+
+	message_release (alarm->message);
+	head = atomic_load_explicit(&free_alarms, memory_order_relaxed);
+	do
+		alarm->link = head;
+	while (!atomic_compare_exchange_weak_explicit(&free_alarms, &head, alarm,
+		memory_order_release, memory_order_relaxed));
+	atomic_fetch_sub_explicit(&pending_alarms, 1, memory_order_relaxed);
+}
+
+/*
+ * Interned messages. Each distinct text is stored once, in chunks
+ * that never move, so display threads can read messages while main
+ * adds new ones. Only main interns; the hash table is its own.
+ *
+ * Every message counts the alarms that use it: main takes a reference
+ * when it interns a text, and alarm_free drops it. A message nobody
+ * uses is left where it is, in case its text comes back, until main
+ * runs short of room; then message_reclaim puts its index and text
+ * block back on free lists. Only main reclaims, and a message can
+ * only reach zero references once no alarm holds it, so nothing can
+ * still be reading a text that is reused.
+ */
+#define MESSAGE_CHUNK	4096		/* index entries per chunk */
+#define MESSAGE_CHUNKS	4096		/* 2^24 messages, the width of alarm_t.message */
+#define MESSAGE_NONE	UINT32_MAX	/* message_intern is out of room */
+#define ARENA_BYTES		(1 << 20)	/* text bytes per chunk */
+#define TEXT_UNIT		sizeof (char*)	/* text blocks are multiples of this */
+#define TEXT_CLASSES	16			/* free lists, by size in TEXT_UNITs */
+
+char **message_index[MESSAGE_CHUNKS];	/* NULL if the entry is free */
+atomic_uint *message_refs[MESSAGE_CHUNKS];	/* next free entry + 1 if free */
+uint32_t message_count = 0;		/* entries ever used */
+uint32_t message_live = 0;		/* entries in the hash table */
+uint32_t message_free = 0;		/* first free entry + 1, 0 if none */
+atomic_long message_dead = 0;	/* in the hash table but unused */
+char *arena_next = NULL, *arena_end = NULL;
+char *text_free[TEXT_CLASSES];	/* freed text blocks, linked through their first word */
+uint32_t *message_hash = NULL;	/* index + 1, 0 if empty */
+uint32_t hash_size = 0;			/* a power of two */
+size_t message_bytes = 0;
+
+const char *message_text (uint32_t message)
+{
+	return message_index[message / MESSAGE_CHUNK][message % MESSAGE_CHUNK];
+}
+
+atomic_uint *message_ref (uint32_t message)
+{
+	return &message_refs[message / MESSAGE_CHUNK][message % MESSAGE_CHUNK];
+}
+
+/*
+ * Drop a reference to a message. Any thread may call this.
+ */
+void message_release (uint32_t message)
+{
+	if (atomic_fetch_sub (message_ref (message), 1) == 1)
+		atomic_fetch_add (&message_dead, 1);
+}
+
+uint32_t message_hash_of (const char *text)
+{
+	uint32_t hash = 2166136261u; /* FNV-1a */
+
+	while (*text)
+		hash = (hash ^ (unsigned char)*text++) * 16777619u;
+	return hash;
+}
+
+/*
+ * Put "message" in the hash table, which must have room for it.
+ */
+void message_hash_add (uint32_t message)
+{
+	uint32_t slot;
+
+	slot = message_hash_of (message_text (message)) & (hash_size - 1);
+	while (message_hash[slot] != 0)
+		slot = (slot + 1) & (hash_size - 1);
+	message_hash[slot] = message + 1;
+}
+
+/*
+ * Free every message that no alarm uses, and rebuild the hash table
+ * from the ones left.
+ */
+void message_reclaim (void)
+{
+	uint32_t message, size;
+	char *text;
+
+	for (message = 0; message < message_count; message++) {
+		text = message_index[message / MESSAGE_CHUNK][message % MESSAGE_CHUNK];
+		if (text == NULL || atomic_load (message_ref (message)) != 0)
+			continue;
+		size = (strlen (text) + TEXT_UNIT) / TEXT_UNIT;
+		*(char**)text = text_free[size];
+		text_free[size] = text;
+		message_index[message / MESSAGE_CHUNK][message % MESSAGE_CHUNK] = NULL;
+		atomic_store (message_ref (message), message_free);
+		message_free = message + 1;
+		message_live--;
+		atomic_fetch_sub (&message_dead, 1);
+	}
+	memset (message_hash, 0, hash_size * sizeof (uint32_t));
+	for (message = 0; message < message_count; message++)
+		if (message_index[message / MESSAGE_CHUNK][message % MESSAGE_CHUNK] != NULL)
+			message_hash_add (message);
+}
+
+/*
+ * Return the index of "text", adding it if it hasn't been seen, and
+ * take a reference to it. Returns MESSAGE_NONE if all 2^24 entries
+ * are in use. "text" may be at most TEXT_CLASSES * TEXT_UNIT - 1
+ * bytes long.
+ */
+uint32_t message_intern (const char *text)
+{
+	uint32_t slot, message, old_size, *old_hash, size;
+	size_t len;
+	char *block;
+
+	if (message_live * 2 >= hash_size) {
+		old_hash = message_hash;
+		old_size = hash_size;
+		hash_size = hash_size == 0 ? 1024 : hash_size * 2;
+		message_hash = (uint32_t*)calloc (hash_size, sizeof (uint32_t));
+		if (message_hash == NULL)
+			errno_abort ("Allocate message hash");
+		message_bytes += (hash_size - old_size) * sizeof (uint32_t);
+		for (slot = 0; slot < old_size; slot++)
+			if (old_hash[slot] != 0)
+				message_hash_add (old_hash[slot] - 1);
+		free (old_hash);
+	}
+
+	slot = message_hash_of (text) & (hash_size - 1);
+	while (message_hash[slot] != 0) {
+		message = message_hash[slot] - 1;
+		if (strcmp (message_text (message), text) == 0) {
+			if (atomic_fetch_add (message_ref (message), 1) == 0)
+				atomic_fetch_sub (&message_dead, 1);
+			return message;
+		}
+		slot = (slot + 1) & (hash_size - 1);
+	}
+
+	/*
+	 * A new text. Before growing the table, reclaim unused messages
+	 * if a quarter of them are unused, or if the index is full.
+	 */
+	len = strlen (text) + 1;
+	size = (len + TEXT_UNIT - 1) / TEXT_UNIT;
+	if ((message_free == 0 && message_count % MESSAGE_CHUNK == 0)
+		|| (text_free[size] == NULL && arena_end - arena_next < size * TEXT_UNIT)) {
+		if (atomic_load (&message_dead) > 0
+			&& (atomic_load (&message_dead) >= message_live / 4
+				|| message_count / MESSAGE_CHUNK >= MESSAGE_CHUNKS))
+			message_reclaim ();
+		/* the text isn't in the table, so its slot can be found afresh */
+		slot = message_hash_of (text) & (hash_size - 1);
+		while (message_hash[slot] != 0)
+			slot = (slot + 1) & (hash_size - 1);
+	}
+
+	if (message_free != 0) {
+		message = message_free - 1;
+		message_free = atomic_load (message_ref (message));
+	} else if (message_count / MESSAGE_CHUNK >= MESSAGE_CHUNKS) {
+		return MESSAGE_NONE;
+	} else {
+		message = message_count++;
+		if (message % MESSAGE_CHUNK == 0) {
+			message_index[message / MESSAGE_CHUNK] = (char**)malloc (MESSAGE_CHUNK * sizeof (char*));
+			message_refs[message / MESSAGE_CHUNK] = (atomic_uint*)malloc (MESSAGE_CHUNK * sizeof (atomic_uint));
+			if (message_index[message / MESSAGE_CHUNK] == NULL
+				|| message_refs[message / MESSAGE_CHUNK] == NULL)
+				errno_abort ("Allocate message index");
+			message_bytes += MESSAGE_CHUNK * (sizeof (char*) + sizeof (atomic_uint));
+		}
+	}
+	block = text_free[size];
+	if (block != NULL)
+		text_free[size] = *(char**)block;
+	else {
+		if (arena_end - arena_next < size * TEXT_UNIT) {
+			arena_next = (char*)malloc (ARENA_BYTES);
+			if (arena_next == NULL)
+				errno_abort ("Allocate message arena");
+			arena_end = arena_next + ARENA_BYTES;
+			message_bytes += ARENA_BYTES;
+		}
+		block = arena_next;
+		arena_next += size * TEXT_UNIT;
+	}
+	memcpy (block, text, len);
+	atomic_init (message_ref (message), 1);
+	message_index[message / MESSAGE_CHUNK][message % MESSAGE_CHUNK] = block;
+	message_hash[slot] = message + 1;
+	message_live++;
+	return message;
+}
+
+alarm_t *alarm_list[PRIORITY_CLASSES]; /*intermediate storage for new alarm requests, owned by alarm thread */
+
+/*
+ * Display shards. Request number n goes to shard (n - 1) % shard_count,
+ * so with two shards odd requests go to Display Thread 1 and even
+ * requests to Display Thread 2. One mutex for each list because they
+ * may be accessed at different times.
+ *
+ * The number of shards (and display threads) adapts to the load,
+ * between SHARDS_MIN and SHARDS_MAX; see shard_scale.
+ */
+#define SHARDS_MIN	2
+#define SHARDS_MAX	16
+#define GROW_DEPTH	32	/* alarms waiting on one shard */
+#define GROW_LATE	2	/* seconds an alarm expired late */
+#define SCALE_HOLD	5	/* seconds between changes in shard count */
+
+typedef struct shard_tag {
+	pthread_mutex_t		mutex;
+	alarm_t				*list[PRIORITY_CLASSES];	/* each sorted by expiration time */
+	int					depth;	/* number of alarms on the lists */
+	int					late;	/* worst lateness since last look, seconds */
+	pthread_t			thread;
+} shard_t;
+
+shard_t shards[SHARDS_MAX];
+atomic_int shard_count = SHARDS_MIN;
+
+/*
+ * Staging ring between a producer (main) and the alarm thread.
+ *
+ * Each producer owns one ring, so there is exactly one writer and
+ * one reader and no lock is needed. "head" and "tail" are running
+ * sequence numbers rather than indexes: the producer only writes
+ * head, the consumer only writes tail, and the slot for sequence n
+ * is n % STAGE_SIZE. Submitting never waits for the alarm thread
+ * unless the ring is full.
+ */
+#define STAGE_SIZE 1024 /* must be a power of two */
+
+typedef struct stage_tag {
+	alarm_t				*slot[STAGE_SIZE];
+	atomic_uint			head; /* next sequence number to fill */
+	atomic_uint			tail; /* next sequence number to take */
+} stage_t;
+
+stage_t main_stage[PRIORITY_CLASSES]; /* main is the only producer, one ring per class */
+
+/*
+ * Admission control. With a limit set, main checks every new alarm
+ * against the number pending (admit_pending) and the number not yet
+ * handed to a display thread (admit_backlog) before taking it. Only
+ * main admits, so the counters are plain; staged_alarms is the
+ * backlog, raised by main and lowered by the alarm thread.
+ */
+#define ADMIT_BLOCK		0	/* wait until there is room */
+#define ADMIT_REJECT	1	/* refuse with an error line */
+#define ADMIT_SHED		2	/* refuse less urgent classes first */
+
+int admit_policy = ADMIT_BLOCK;
+unsigned long admit_pending = 0; /* 0 means no limit */
+unsigned long admit_backlog = 0;
+atomic_ulong staged_alarms = 0;
+unsigned long admitted_count = 0;
+unsigned long rejected_count[PRIORITY_CLASSES];
+unsigned long blocked_count = 0;
+unsigned long pending_high = 0, backlog_high = 0;
+
+/*
+ * Submission latency histogram, in powers of two nanoseconds, from
+ * the moment main has read a request until the alarm is on the ring:
+ * parsing, admission, main's own output and the handoff itself.
+ * Only main writes it.
+ */
+#define LATENCY_BUCKETS 40
+unsigned long submit_latency[LATENCY_BUCKETS];
+unsigned long submit_count = 0;
+
+/*
+ * Put an alarm on the ring. Returns 0 if the ring is full.
+ */
+int stage_push (stage_t *stage, alarm_t *alarm)
+{
+	unsigned int head, tail;
+
+	head = atomic_load_explicit(&stage->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&stage->tail, memory_order_acquire);
+	if (head - tail == STAGE_SIZE)
+		return 0;
+	stage->slot[head & (STAGE_SIZE - 1)] = alarm;
+	/* publish the slot before the new head */
+	atomic_store_explicit(&stage->head, head + 1, memory_order_release);
+	return 1;
+}
+
+/*
+ * Take the oldest alarm off the ring, or NULL if it is empty.
+ */
+alarm_t *stage_pop (stage_t *stage)
+{
+	unsigned int head, tail;
+	alarm_t *alarm;
+
+	tail = atomic_load_explicit(&stage->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&stage->head, memory_order_acquire);
+	if (head == tail)
+		return NULL;
+	alarm = stage->slot[tail & (STAGE_SIZE - 1)];
+	/* hand the slot back to the producer */
+	atomic_store_explicit(&stage->tail, tail + 1, memory_order_release);
+	return alarm;
+}
+
+/*
+ * Record how long one submission took.
+ */
+void latency_record (struct timespec *start, struct timespec *end)
+{
+	long ns;
+	int bucket;
+
+	ns = (end->tv_sec - start->tv_sec) * 1000000000L
+		+ (end->tv_nsec - start->tv_nsec);
+	for (bucket = 0; bucket < LATENCY_BUCKETS - 1 && (1L << bucket) < ns; bucket++)
+		;
+	submit_latency[bucket]++;
+	submit_count++;
+}
+
+/*
+ * Upper bound, in nanoseconds, of the given percentile of
+ * submission latency.
+ */
+long latency_percentile (int percent)
+{
+	unsigned long seen, want;
+	int bucket;
+
+	want = (submit_count * percent + 99) / 100;
+	seen = 0;
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += submit_latency[bucket];
+		if (seen >= want)
+			break;
+	}
+	return 1L << bucket;
+}
+
+/*
+ * Thread timeline tracing, enabled with "-t <file>".
+ *
+ * Every traced thread appends fixed-size events to a buffer of its
+ * own, so recording takes no lock; a full buffer just drops events.
+ * Spans are only recorded where a thread waited: a lock wait only
+ * when trylock fails, and a yield only when other threads ran for at
+ * least TRACE_MIN_NS. A yield that follows a span of the same kind
+ * within TRACE_MIN_NS extends that span instead, so a thread spinning
+ * idle shows up as one span rather than filling its buffer. At exit
+ * main writes every buffer out as Chrome trace-event JSON, one
+ * timeline row per thread.
+ *
+ * Buffers have fixed slots: main, the alarm thread, then one per
+ * shard. A display thread started again for a shard that was removed
+ * carries on in the buffer (and on the row) of the one before it.
+ */
+#define TRACE_MAIN		0
+#define TRACE_ALARM		1
+#define TRACE_SHARD		2	/* + shard index */
+#define TRACE_THREADS	(TRACE_SHARD + SHARDS_MAX)
+#define TRACE_EVENTS	65536	/* per thread */
+#define TRACE_MIN_NS	10000
+
+enum trace_kind {
+	TRACE_LOCK_WAIT,	/* span: blocked on a shard mutex */
+	TRACE_YIELD,		/* span: gave up the CPU */
+	TRACE_RING_FULL,	/* span: main waiting for room on a ring */
+	TRACE_ADMIT_WAIT,	/* span: main held back by admission control */
+	TRACE_SUBMIT,		/* instant: main put an alarm on a ring */
+	TRACE_HANDOFF,		/* instant: alarm thread passed an alarm to a shard */
+	TRACE_EXPIRE,		/* instant: display thread fired an alarm */
+	TRACE_SCALE			/* instant: display pool resized */
+};
+
+const char *trace_names[] = {
+	"lock wait", "yield", "ring full", "admission wait",
+	"submit", "handoff", "expire", "scale"
+};
+
+typedef struct trace_event_tag {
+	uint64_t			start;	/* ns on CLOCK_MONOTONIC */
+	_Atomic uint32_t	length;	/* ns, 0 for an instant; grows while yields coalesce */
+	uint16_t			kind;
+	uint16_t			shard;	/* display thread number, or 0 */
+	uint32_t			request_num;
+} trace_event_t;
+
+typedef struct trace_buf_tag {
+	char				name[32];
+	int					tid;
+	atomic_uint			count;	/* events published so far */
+	unsigned long		dropped;
+	trace_event_t		*event;
+} trace_buf_t;
+
+const char *trace_file = NULL;
+trace_buf_t trace_bufs[TRACE_THREADS];
+__thread trace_buf_t *trace_self = NULL;
+
+uint64_t trace_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Give the calling thread the trace buffer in the given slot,
+ * allocating it the first time. Does nothing unless tracing is on.
+ * Only one thread at a time may use a slot.
+ */
+void trace_thread (int slot, const char *name)
+{
+	trace_buf_t *buf;
+
+	if (trace_file == NULL)
+		return;
+	buf = &trace_bufs[slot];
+	if (buf->event == NULL) {
+		snprintf(buf->name, sizeof(buf->name), "%s", name);
+		buf->tid = slot + 1;
+		buf->dropped = 0;
+		buf->event = (trace_event_t*)malloc(TRACE_EVENTS * sizeof(trace_event_t));
+		if (buf->event == NULL)
+			errno_abort("Allocate trace buffer");
+	}
+	trace_self = buf;
+}
+
+/*
+ * Record an event on the calling thread's buffer.
+ */
+void trace_record (int kind, uint64_t start, uint64_t end, int shard, uint32_t request_num)
+{
+	trace_buf_t *buf = trace_self;
+	trace_event_t *event;
+	unsigned int count;
+
+	if (buf == NULL)
+		return;
+	count = atomic_load_explicit(&buf->count, memory_order_relaxed);
+	if (count == TRACE_EVENTS) {
+		buf->dropped++;
+		return;
+	}
+	event = &buf->event[count];
+	event->start = start;
+	atomic_store_explicit(&event->length, (uint32_t)(end - start), memory_order_relaxed);
+	event->kind = kind;
+	event->shard = shard;
+	event->request_num = request_num;
+	/* publish the event before the count that covers it */
+	atomic_store_explicit(&buf->count, count + 1, memory_order_release);
+}
+
+/*
+ * Lock a shard's mutex, recording the wait if it was contended.
+ */
+void shard_lock (int index)
+{
+	uint64_t start;
+
+	if (trace_self == NULL) {
+		pthread_mutex_lock(&shards[index].mutex);
+		return;
+	}
+	if (pthread_mutex_trylock(&shards[index].mutex) == 0)
+		return;
+	start = trace_clock();
+	pthread_mutex_lock(&shards[index].mutex);
+	trace_record(TRACE_LOCK_WAIT, start, trace_clock(), index + 1, 0);
+}
+
+/*
+ * sched_yield, recording the time away as the given kind of span if
+ * it was long enough to mean another thread ran, or adding it to the
+ * thread's last event if that is a span of the same kind that ended
+ * less than TRACE_MIN_NS before.
+ */
+void trace_yield (int kind)
+{
+	trace_buf_t *buf = trace_self;
+	trace_event_t *last;
+	uint64_t start, end, last_end;
+	unsigned int count;
+
+	if (buf == NULL) {
+		sched_yield ();
+		return;
+	}
+	start = trace_clock();
+	sched_yield ();
+	end = trace_clock();
+	count = atomic_load_explicit(&buf->count, memory_order_relaxed);
+	if (count > 0) {
+		last = &buf->event[count - 1];
+		last_end = last->start + atomic_load_explicit(&last->length, memory_order_relaxed);
+		if (last->kind == kind && start - last_end < TRACE_MIN_NS
+			&& end - last->start <= UINT32_MAX) {
+			atomic_store_explicit(&last->length, (uint32_t)(end - last->start), memory_order_relaxed);
+			return;
+		}
+	}
+	if (end - start >= TRACE_MIN_NS)
+		trace_record(kind, start, end, 0, 0);
+}
+
+/*
+ * Write every buffer to trace_file as Chrome trace-event JSON.
+ * Events other threads are still recording are left out.
+ */
+void trace_write (void)
+{
+	trace_buf_t *buf;
+	trace_event_t *event;
+	unsigned int count, i;
+	uint64_t base;
+	unsigned long events = 0, dropped = 0;
+	int threads = 0, slot;
+	FILE *file;
+
+	if (trace_file == NULL)
+		return;
+	file = fopen(trace_file, "w");
+	if (file == NULL)
+		errno_abort("Open trace file");
+	/* timestamps are relative to the earliest event */
+	base = UINT64_MAX;
+	for (slot = 0; slot < TRACE_THREADS; slot++) {
+		buf = &trace_bufs[slot];
+		if (buf->event != NULL
+			&& atomic_load_explicit(&buf->count, memory_order_acquire) > 0
+			&& buf->event[0].start < base)
+			base = buf->event[0].start;
+	}
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"My_Alarm\"}}");
+	for (slot = 0; slot < TRACE_THREADS; slot++) {
+		buf = &trace_bufs[slot];
+		if (buf->event == NULL)
+			continue;
+		threads++;
+		fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+			buf->tid, buf->name);
+		count = atomic_load_explicit(&buf->count, memory_order_acquire);
+		for (i = 0; i < count; i++) {
+			event = &buf->event[i];
+			fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"alarm\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, ",
+				trace_names[event->kind], buf->tid, (event->start - base) / 1000.0);
+			if (event->kind < TRACE_SUBMIT)
+				fprintf(file, "\"ph\": \"X\", \"dur\": %.3f",
+					atomic_load_explicit(&event->length, memory_order_relaxed) / 1000.0);
+			else
+				fprintf(file, "\"ph\": \"i\", \"s\": \"t\"");
+			fprintf(file, ", \"args\": {\"shard\": %d, \"request\": %u}}",
+				event->shard, event->request_num);
+		}
+		events += count;
+		dropped += buf->dropped;
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	fprintf(stderr, "Trace: %lu events from %d threads written to %s (%lu dropped)\n",
+		events, threads, trace_file, dropped);
+}
+
+/*
+ * Print statistics to stderr.
+ */
+void stats_print (void)
+{
+	unsigned long pending, fired;
+	int class;
+
+	pending = atomic_load(&pending_alarms);
+	fprintf(stderr, "Submitted: %lu  latency p50 <= %ld ns  p99 <= %ld ns\n",
+		submit_count, latency_percentile(50), latency_percentile(99));
+	fprintf(stderr, "Pending: %lu  alarm slab %zu bytes  messages %u in %zu bytes  (%.1f bytes per pending alarm)\n",
+		pending, slab_bytes, message_live, message_bytes,
+		pending == 0 ? 0.0 : (double)(slab_bytes + message_bytes) / pending);
+	fprintf(stderr, "Admission: %s  limits %lu pending %lu backlog  admitted %lu  blocked %lu  high water %lu pending %lu backlog\n",
+		admit_policy == ADMIT_BLOCK ? "block" : admit_policy == ADMIT_REJECT ? "reject" : "shed",
+		admit_pending, admit_backlog, admitted_count, blocked_count, pending_high, backlog_high);
+	for (class = 0; class < PRIORITY_CLASSES; class++) {
+		fired = atomic_load(&fired_count[class]);
+		fprintf(stderr, "Priority(%d): fired %lu  rejected %lu  lateness mean %lu ms  max %lu ms\n",
+			class, fired, rejected_count[class],
+			fired == 0 ? 0 : atomic_load(&late_total[class]) / fired,
+			atomic_load(&late_max[class]));
+	}
+}
+
+/*
+ * Decide whether main may take a new alarm of the given class.
+ *
+ * Under ADMIT_SHED each class gets a share of the limits: class c
+ * is refused once the load passes (PRIORITY_CLASSES - c) /
+ * PRIORITY_CLASSES of a limit, so the least urgent class is shed
+ * first and class 0 may use all of it. Returns 0 if refused.
+ */
+int admit (int priority)
+{
+	unsigned long pending, backlog, share;
+	int waited = 0;
+
+	while (1) {
+		pending = atomic_load(&pending_alarms);
+		backlog = atomic_load(&staged_alarms);
+		share = admit_policy == ADMIT_SHED ? PRIORITY_CLASSES - priority : PRIORITY_CLASSES;
+		if ((admit_pending == 0 || pending * PRIORITY_CLASSES < admit_pending * share)
+			&& (admit_backlog == 0 || backlog * PRIORITY_CLASSES < admit_backlog * share))
+			break;
+		if (admit_policy != ADMIT_BLOCK) {
+			rejected_count[priority]++;
+			return 0;
+		}
+		if (!waited)
+			blocked_count++;
+		waited = 1;
+		trace_yield (TRACE_ADMIT_WAIT);
+	}
+	admitted_count++;
+	if (pending + 1 > pending_high)
+		pending_high = pending + 1;
+	if (backlog + 1 > backlog_high)
+		backlog_high = backlog + 1;
+	return 1;
+}
+
+/*
+ * Hand a new alarm to the alarm thread. This never waits on the
+ * alarm thread or the display threads, and takes no lock they use
+ * (the alarm thread prints main's receipt line); only a full ring
+ * makes main yield until there is room. Only main calls this.
+ */
+void submit (alarm_t *alarm)
+{
+	atomic_fetch_add(&staged_alarms, 1);
+	while (!stage_push(&main_stage[alarm->priority], alarm))
+		trace_yield (TRACE_RING_FULL);
+}
+
+/*
+ * Submission latency benchmark ("-q <count>"). Time LATENCY_SAMPLES
+ * submissions, spaced out, first while nothing is due and then while
+ * <count> alarms that are already due keep the alarm thread and the
+ * display threads printing, and report p50 and p99 for each. The
+ * timed alarms are due in a day, so they add nothing to the output.
+ * Redirect stdout to a file or /dev/null; the results go to stderr.
+ */
+#define LATENCY_SAMPLES	1000
+
+void latency_bench (unsigned long count)
+{
+	struct timespec start, end, gap = {0, 50000};
+	alarm_t *alarm;
+	unsigned long i, staged;
+	uint32_t number = 0;
+	int phase;
+
+	for (phase = 0; phase < 2; phase++) {
+		memset (submit_latency, 0, sizeof (submit_latency));
+		submit_count = 0;
+		for (i = 0; phase == 1 && i < count; i++) {
+			alarm = alarm_alloc ();
+			alarm->seconds = 0;
+			alarm->priority = PRIORITY_NORMAL;
+			alarm->message = message_intern ("due now");
+			alarm->time = clock_rel ();
+			alarm->request_num = ++number;
+			submit (alarm);
+		}
+		staged = atomic_load(&staged_alarms);
+		for (i = 0; i < LATENCY_SAMPLES; i++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			alarm = alarm_alloc ();
+			alarm->seconds = 86400;
+			alarm->priority = PRIORITY_NORMAL;
+			alarm->message = message_intern ("timed");
+			alarm->time = clock_rel () + alarm->seconds;
+			alarm->request_num = ++number;
+			submit (alarm);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			latency_record(&start, &end);
+			nanosleep (&gap, NULL);
+		}
+		/* how many alarms the alarm thread handed on meanwhile */
+		staged += LATENCY_SAMPLES - atomic_load(&staged_alarms);
+		fprintf (stderr, "%s: %d submissions  p50 <= %ld ns  p99 <= %ld ns  (%lu alarms dispatched meanwhile)\n",
+			phase == 0 ? "Idle" : "Saturated", LATENCY_SAMPLES,
+			latency_percentile(50), latency_percentile(99), staged);
+	}
+}
+
+/*
+ * Memory benchmark: create "count" pending alarms, drawing their
+ * messages from "distinct" different texts, and report the memory
+ * used. Nothing is started, so only the representation is measured.
+ */
+void memory_bench (unsigned long count, unsigned long distinct)
+{
+	alarm_t *list, *alarm;
+	char message[65];
+	unsigned long i;
+	long pages, resident;
+	FILE *file;
+	uint32_t interned;
+
+	list = NULL;
+	for (i = 0; i < count; i++) {
+		alarm = alarm_alloc ();
+		snprintf (message, sizeof (message), "Message number %lu", i % distinct);
+		interned = message_intern (message);
+		if (interned == MESSAGE_NONE) {
+			fprintf (stderr, "Too many distinct messages\n");
+			exit (1);
+		}
+		alarm->message = interned;
+		alarm->seconds = (int32_t)(i % 86400);
+		alarm->priority = i % PRIORITY_CLASSES;
+		alarm->time = alarm->seconds;
+		alarm->request_num = (uint32_t)(i + 1);
+		alarm->link = list;
+		list = alarm;
+	}
+	stats_print ();
+	file = fopen ("/proc/self/statm", "r");
+	if (file != NULL) {
+		if (fscanf (file, "%ld %ld", &pages, &resident) == 2)
+			fprintf (stderr, "Resident: %ld bytes (%.1f bytes per alarm)\n",
+				resident * sysconf (_SC_PAGESIZE),
+				(double)resident * sysconf (_SC_PAGESIZE) / count);
+		fclose (file);
+	}
+}
+
+/*
+ * Move everything on a class's staging ring onto its alarm_list,
+ * sorted by expiration time. Only the alarm thread calls this.
+ */
+void stage_drain (stage_t *stage, alarm_t **list)
+{
+	alarm_t *alarm, *last, *next;
+
+	while ((alarm = stage_pop(stage)) != NULL)
+	{
+		/*
+		 * Main's receipt line is printed here, on its behalf, so
+		 * main never takes the stdout lock while it submits.
+		 */
+		fprintf(stdout, "Main Thread Received Alarm Request Number:(%d) Alarm Request: (%d) [\"%s\"]\n",
+			alarm->request_num, alarm->seconds, message_text (alarm->message));
+
+		/*
+		 * Insert the new alarm into the list of alarms,
+		 * sorted by expiration time.
+		 */
+		last = NULL;
+		next = *list;
+		if(next == NULL)//first entry into list
+		{
+			*list = alarm;
+			alarm->link = NULL;
+		}
+		else
+		{
+			while(next != NULL)//iterate through list
+			{
+				//insert before smallest time that's still larger than alarm.time
+				if(alarm->time <= next->time)
+				{
+					alarm->link = next;
+					if(last != NULL)
+						last->link = alarm;
+					else
+						*list = alarm;
+					
+					break;
+				}
+			last = next;
+			next = next->link;//iterate
+			
+			}
+			if(next == NULL)
+			{
+				last->link = alarm;
+				alarm->link = NULL;
+			}
+		}
+#ifdef DEBUG
+		printf ("[list %d: ", alarm->priority);
+		for (next = *list; next != NULL; next = next->link)
+			printf ("%d(%d)[\"%s\"] ", next->time,
+				next->time - clock_rel (), message_text (next->message));
+		printf ("]\n");
+#endif
+	}
+}
+
+
+/*
+ * Insert an alarm into a shard's list for its class, sorted by
+ * expiration time.
+ * The caller must hold the shard's mutex.
+ */
+void shard_insert (shard_t *shard, alarm_t *alarm)
+{
+	alarm_t *last, *next;
+
+	last = NULL;
+	next = shard->list[alarm->priority];
+	if(next == NULL)//first entry into list
+	{
+		shard->list[alarm->priority] = alarm;
+		alarm->link = NULL;
+	}
+	else
+	{
+		while(next != NULL)//iterate through list
+		{
+			if(alarm->time <= next->time)
+			{
+				alarm->link = next; //insert in between items
+				if(last != NULL)
+					last->link = alarm;
+				else
+					shard->list[alarm->priority] = alarm;
+				
+				break;
+			}
+		last = next;
+		next = next->link; //iterate
+		
+		}
+		if(next == NULL)
+		{
+			last->link = alarm;
+			alarm->link = NULL;
+		}
+	}
+	shard->depth++;
+}
+
+void *display_thread_r (void *arg);
+
+/*
+ * Start the display thread for a shard.
+ */
+void shard_start (int index)
+{
+	pthread_attr_t attr;
+	int status;
+
+	status = pthread_attr_init (&attr);
+	if (status != 0)
+		err_abort (status, "Init thread attributes");
+	status = pthread_create (
+		&shards[index].thread, placement_attr (&attr, 1 + index),
+		display_thread_r, (void*)(intptr_t)index);
+	if (status != 0)
+		err_abort (status, "Create display thread");
+	pthread_attr_destroy (&attr);
+}
+
+/*
+ * Grow or shrink the display pool. Called by the alarm thread,
+ * which is the only thread that changes shard_count.
+ *
+ * A shard is added when any shard has more than GROW_DEPTH alarms
+ * waiting or has expired an alarm GROW_LATE seconds late; one is
+ * removed when every shard is empty. Changes are at least
+ * SCALE_HOLD seconds apart so the pool doesn't flap.
+ *
+ * To rebalance, every shard mutex is taken (in index order), all
+ * pending alarms are pulled off the lists and reinserted under the
+ * new mapping, and only then are the mutexes released. A display
+ * thread fires and unlinks an alarm only while holding its shard's
+ * mutex, so no alarm can be missed or fired twice in between.
+ */
+void shard_scale (void)
+{
+	static time_t last_change = 0;
+	alarm_t *pending, *alarm, *next;
+	time_t now;
+	int index, class, grow, idle, old, count;
 
+	now = time (NULL);
+	if (now - last_change < SCALE_HOLD)
+		return;
+	old = atomic_load (&shard_count);
+	grow = 0;
+	idle = 1;
+	for (index = 0; index < old; index++) {
+		shard_lock (index);
+		if (shards[index].depth > GROW_DEPTH || shards[index].late >= GROW_LATE)
+			grow = 1;
+		if (shards[index].depth > 0)
+			idle = 0;
+		shards[index].late = 0;
+		pthread_mutex_unlock (&shards[index].mutex);
+	}
+	if (grow && old < SHARDS_MAX)
+		count = old + 1;
+	else if (idle && old > SHARDS_MIN)
+		count = old - 1;
+	else
+		return;
+
+	for (index = 0; index < SHARDS_MAX; index++)
+		shard_lock (index);
+	pending = NULL;
+	for (index = 0; index < old; index++) {
+		for (class = 0; class < PRIORITY_CLASSES; class++) {
+			for (alarm = shards[index].list[class]; alarm != NULL; alarm = next) {
+				next = alarm->link;
+				alarm->link = pending;
+				pending = alarm;
+			}
+			shards[index].list[class] = NULL;
+		}
+		shards[index].depth = 0;
+	}
+	atomic_store (&shard_count, count);
+	while (pending != NULL) {
+		alarm = pending;
+		pending = alarm->link;
+		shard_insert (&shards[(alarm->request_num - 1) % count], alarm);
+	}
+	for (index = SHARDS_MAX - 1; index >= 0; index--)
+		pthread_mutex_unlock (&shards[index].mutex);
+
+	/* the removed shard's thread sees it is out of range and exits */
+	if (count > old)
+		shard_start (old);
+	else
+		pthread_join (shards[count].thread, NULL);
+	last_change = now;
+	trace_record (TRACE_SCALE, trace_clock (), trace_clock (), count, 0);
+	fprintf(stdout,"Alarm Thread Changed Number of Display Threads to %d\n", count);
+}
 
 /*
  * The alarm thread's start routine.
@@ -52,334 +1105,218 @@ void *alarm_thread (void *arg)
 {
 	alarm_t *current_alarm;
     alarm_t *alarm;
-	alarm_t *even_alarm, *odd_alarm;
     int sleep_time;
     time_t now;
-    int status;
+	int class;
 	
+	trace_thread (TRACE_ALARM, "alarm thread");
 	
-	/*Make new even_alarm*/
-	even_alarm = (alarm_t*)malloc (sizeof (alarm_t));
-       if (even_alarm == NULL)
-           errno_abort ("Allocate even alarm");
-	/*Make new odd_alarm*/
-	odd_alarm = (alarm_t*)malloc (sizeof (alarm_t));
-       if (odd_alarm == NULL)
-           errno_abort ("Allocate odd alarm");
     /*
      * Loop forever, processing commands. The alarm thread will
      * be disintegrated when the process exits.
      */
     while (1) {
 		
-		/* lock main alarm list to prevent adding removing while it's processed */
-        status = pthread_mutex_lock (&alarm_mutex);
-        if (status != 0)
-            err_abort (status, "Lock mutex");
-        alarm = alarm_list; //get first item
-		//make an alarm copy so as not to interfere with the list
-		current_alarm = NULL;
-		if(alarm != NULL)
-		{
-			current_alarm = (alarm_t*)malloc (sizeof (alarm_t));
-			if (current_alarm == NULL)
-				errno_abort ("Allocate even alarm");
-			memcpy(current_alarm, alarm, sizeof alarm);
-			current_alarm->link = NULL; //should not have link for this list
-			current_alarm->seconds = alarm->seconds;
-			current_alarm->time = alarm->time;
-			strcpy(current_alarm->message, alarm->message);
-			current_alarm->request_num = alarm->request_num;
-		}
+		/* pick up new requests -- alarm_list belongs to this thread only */
+		for (class = 0; class < PRIORITY_CLASSES; class++)
+			stage_drain(&main_stage[class], &alarm_list[class]);
+		/*
+		 * Hand over everything picked up before giving up the CPU,
+		 * so a cohort arriving together isn't passed on one alarm
+		 * per time slice.
+		 */
+		while (1) {
+			/* most urgent class first */
+			for (class = 0; class < PRIORITY_CLASSES - 1 && alarm_list[class] == NULL; class++)
+				;
+            alarm = alarm_list[class]; //get first item
+			//the same node moves on to the shard, there is no copy
+			current_alarm = alarm;
 		
-        /*
-         * If the alarm list is empty, wait for one second. This
-         * allows the main thread to run, and read another
-         * command. If the list is not empty, remove the first
-         * item. Compute the number of seconds to wait -- if the
-         * result is less than 0 (the time has passed), then set
-         * the sleep_time to 0.
-         */
-        if (current_alarm == NULL)
-            sleep_time = 1;
-        else {
-			if(current_alarm->request_num % 2 == 1)/* request is odd*/
-			{
-				alarm_t *last, *next;
-				
-				pthread_mutex_lock(&odd_alarm_mutex);
-				/*
-				* Insert the new alarm into the list of odd alarms,
-				* sorted by expiration time.
-				*/
-				last = NULL;
-				next = odd_alarm_list;
-				if(next == NULL)//first entry into list
-				{
-					odd_alarm_list = alarm;
-					current_alarm->link = NULL;
-				}
-				else
-				{
-					while(next != NULL)//iterate through list
-					{
-						if(current_alarm->time <= next->time)
-						{
-							current_alarm->link = next; //insert in between items
-							if(last != NULL)
-								last->link = current_alarm;
-							else
-								odd_alarm_list = current_alarm;
-							
-							break;
-						}
-					last = next;
-					next = next->link; //iterate
-					
-					}
-					if(next == NULL)
-					{
-						last->link = current_alarm;
-					}
-				}
-				
-				pthread_mutex_unlock(&odd_alarm_mutex); /*unlock -- done with list */
-				fprintf(stdout,"Alarm Thread Passed on Alarm Request to Display Thread 1 Alarm Request Number:(%d) Alarm Request: (%d) [\"%s\"]\n",
-					current_alarm->request_num, current_alarm->seconds, current_alarm->message);
-				
-				fprintf(stdout,"Display Thread 1: Received Alarm Request Number:%d Alarm Request: (%d) [\"%s\"]\n",
-					current_alarm->request_num, current_alarm->seconds, current_alarm->message);
-				
-			}
-			else /* request is even*/
-			{
-				alarm_t *last, *next;
-				
-				pthread_mutex_lock(&even_alarm_mutex);
-				/*
-				* Insert the new alarm into the list of alarms,
-				* sorted by expiration time.
-				*/
-				last = NULL;
-				next = even_alarm_list;
-				if(next == NULL)//first entry into list
-				{
-					even_alarm_list = current_alarm;
-					current_alarm->link = NULL;
-				}
+            /*
+             * If the alarm list is empty, wait for one second. This
+             * allows the main thread to run, and read another
+             * command. If the list is not empty, remove the first
+             * item. Compute the number of seconds to wait -- if the
+             * result is less than 0 (the time has passed), then set
+             * the sleep_time to 0.
+             */
+            if (current_alarm == NULL) {
+                sleep_time = 1;
+				break;
+			} else {
+				/* request n goes to display thread (n - 1) % shard_count + 1 */
+				int index = (current_alarm->request_num - 1) % atomic_load (&shard_count);
+				shard_t *shard = &shards[index];
+			
+				now = clock_rel ();
+				if (alarm->time <= now)
+					sleep_time = 0;
 				else
-				{
-					while(next != NULL)//iterate through list
-					{
-						if(current_alarm->time <= next->time)
-						{
-							current_alarm->link = next;//insert in between items
-							if(last != NULL)
-								last->link = current_alarm;
-							else
-								even_alarm_list = current_alarm;
-							
-							break;
-						}
-					last = next;
-					next = next->link;//iterate
-					
-					}
-					if(next == NULL)
-					{
-						last->link = current_alarm;
-					}
-				}
-				pthread_mutex_unlock(&even_alarm_mutex);/*unlock -- done with list */
-				fprintf(stdout,"Alarm Thread Passed on Alarm Request to Display Thread 2 Alarm Request Number:(%d) Alarm Request: (%d) [\"%s\"]\n",
-					current_alarm->request_num, current_alarm->seconds, current_alarm->message);
-					
-				fprintf(stdout,"Display Thread 2: Received Alarm Request Number:%d Alarm Request: (%d) [\"%s\"]\n",
-					current_alarm->request_num, current_alarm->seconds, current_alarm->message);
-			}
+					sleep_time = 1;//alarm->time - now;
 			
-			/*remove the first item*/
-			alarm_list = alarm->link;
-			now = time (NULL);
-			if (alarm->time <= now)
-				sleep_time = 0;
-			else
-				sleep_time = 1;//alarm->time - now;
+				/*remove the first item*/
+				alarm_list[class] = alarm->link;
+			
+				/* report while the node is still ours; once it is on the shard the display thread may free it */
+				fprintf(stdout,"Alarm Thread Passed on Alarm Request to Display Thread %d Alarm Request Number:(%d) Alarm Request: (%d) [\"%s\"]\n",
+					index + 1, current_alarm->request_num, current_alarm->seconds, message_text (current_alarm->message));
+			
+				fprintf(stdout,"Display Thread %d: Received Alarm Request Number:%d Alarm Request: (%d) [\"%s\"]\n",
+					index + 1, current_alarm->request_num, current_alarm->seconds, message_text (current_alarm->message));
+			
+				trace_record(TRACE_HANDOFF, trace_clock (), trace_clock (), index + 1, current_alarm->request_num);
+				shard_lock(index);
+				shard_insert(shard, current_alarm);
+				pthread_mutex_unlock(&shard->mutex); /*unlock -- done with list */
+				atomic_fetch_sub(&staged_alarms, 1);
             
-            }
-
-        /*
-         * Unlock the mutex before waiting, so that the main
-         * thread can lock it to insert a new alarm request.
-         */
-        status = pthread_mutex_unlock (&alarm_mutex);
-        if (status != 0)
-            err_abort (status, "Unlock mutex");
+                }
+		
+		}
+		
+		shard_scale();
 		//give CPU to main
-        sched_yield ();
+        trace_yield (TRACE_YIELD);
     }
 }
-/*display_thread_1 start routine for handling odd requests*/
- /*odd requests*/
-void *display_thread_1_r (void *arg)
+
+/*display thread start routine, arg is the index of its shard*/
+void *display_thread_r (void *arg)
 {
-	alarm_t *current_alarm;
+	int index = (intptr_t)arg;
+	shard_t *shard = &shards[index];
+	/* alarm being counted down; only looked at under the shard mutex */
+	alarm_t *current_alarm = NULL;
 	alarm_t *next;
-	/*requested amount of seconds */
-	int req_seconds;
-	/*alarm number */
-	int req_num; 
-	/*Alarm message */
-	int alarm_time;
-	/* message */
-	char *str;
+	/* expired alarms being reported */
+	alarm_t *batch, **tail, *fire;
 	
 	/* timestamp to keep track of every 2 seconds */
 	int prev_timestamp;
+	/* priority class, and lateness of an expired alarm */
+	int class;
+	struct timespec ts;
+	unsigned long late, max;
+	char name[32];
 	
+	snprintf(name, sizeof(name), "display_thread_%d", index + 1);
+	trace_thread(TRACE_SHARD + index, name);
 	while(1)
 	{
+		/* shard was removed -- its alarms have been moved elsewhere */
+		if(index >= atomic_load(&shard_count))
+			return NULL;
 
-		if(odd_alarm_list != NULL) /*only if list is not empty */
+		if(shard->depth > 0) /*only if shard is not empty */
 		{
-			/*lock odd alarm mutex so it can be modified without race conditions, etc...*/
-			pthread_mutex_lock(&odd_alarm_mutex);
-			int now = time (NULL);
-			
-			
-			//new request
-			if(current_alarm != odd_alarm_list)//Checking for new request
-			{
-				/*get first node */
-				current_alarm = odd_alarm_list;
-				/* running number of seconds left (diminishing)*/
-				req_seconds = current_alarm->seconds;
-				/*alarm number */
-				req_num = current_alarm->request_num;
-				/*time of request */
-				alarm_time = current_alarm->time;
-				/*Alarm message */
-				str = current_alarm->message;
-				
-				/*timestamp to keep track of every two seconds*/
-				prev_timestamp = now;
-				
-				
-					
-					//DEBUGGING
-			#ifdef DEBUG
-            printf ("[odd list: ");
-            for (next = odd_alarm_list; next != NULL; next = next->link)
-                printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - now, next->message);
-            printf ("]\n");
-			#endif
-			}	
+			/*lock shard mutex so it can be modified without race conditions, etc...*/
+			shard_lock(index);
+			int now = clock_rel ();
 			
-			/* Repeat every two seconds while alarm hasn't expired */
-			if(current_alarm->time - now > 0 && now - prev_timestamp >= 2)
+			//the lists may have been emptied by a rebalance
+			if(shard->depth == 0)
 			{
-				fprintf(stdout,"Display Thread 1: Number of Seconds Left %d : Alarm Request Number: (%d) Alarm Request: (%d) [\"%s\"]\n",
-					current_alarm->time - now, req_num, req_seconds, str);
-				
-				/*reset timestamp */
-				prev_timestamp = now;
+				pthread_mutex_unlock(&shard->mutex);
+				continue;
 			}
-			else if(current_alarm->time - now < 0) //Alarm expired
+			
+			/*
+			 * Take every expired alarm off the lists at once, most
+			 * urgent class first, whatever is due in the less urgent
+			 * classes. They are reported after the mutex is released,
+			 * so the alarm thread isn't held up by the output of a
+			 * large cohort coming due together.
+			 */
+			batch = NULL;
+			tail = &batch;
+			for(class = 0; class < PRIORITY_CLASSES; class++)
+				while(shard->list[class] != NULL && shard->list[class]->time - now < 0)
+				{
+					fire = shard->list[class];
+					shard->list[class] = fire->link;
+					shard->depth--;
+					/* how late it was, for shard_scale */
+					if(now - fire->time > shard->late)
+						shard->late = now - fire->time;
+					if(fire == current_alarm)
+						current_alarm = NULL;
+					*tail = fire;
+					tail = &fire->link;
+				}
+			*tail = NULL;
+			if(batch != NULL)
 			{
-				fprintf(stdout,"Display Thread 1: Alarm Expired at %d : Alarm Request Number: (%d) Alarm Request: (%d) [\"%s\"]\n",
-					time (NULL), req_num, req_seconds, str);
-				printf ("(%d) %s\n", req_seconds, str); /*print alarm after expired */
-				
-				/* remove first node */
-				odd_alarm_list = current_alarm->link;
-				//free(current_alarm);
+				pthread_mutex_unlock(&shard->mutex);
+				clock_gettime(CLOCK_REALTIME, &ts);
+				while(batch != NULL)
+				{
+					fire = batch;
+					batch = fire->link;
+					fprintf(stdout,"Display Thread %d: Alarm Expired at %ld : Alarm Request Number: (%d) Alarm Request: (%d) [\"%s\"]\n",
+						index + 1, (long)ts.tv_sec, fire->request_num, fire->seconds, message_text (fire->message));
+					printf ("(%d) %s\n", fire->seconds, message_text (fire->message)); /*print alarm after expired */
+					
+					/* lateness for the stats */
+					class = fire->priority;
+					late = ts.tv_sec * 1000L + ts.tv_nsec / 1000000
+						- (time_base + fire->time) * 1000L;
+					trace_record(TRACE_EXPIRE, trace_clock (), trace_clock (), index + 1, fire->request_num);
+					atomic_fetch_add(&fired_count[class], 1);
+					atomic_fetch_add(&late_total[class], late);
+					max = atomic_load(&late_max[class]);
+					while(late > max && !atomic_compare_exchange_weak(&late_max[class], &max, late))
+						;
+					alarm_free(fire);
+				}
+				continue;
 			}
 			
-			/* unlock to allow items to be added to odd list */
-				pthread_mutex_unlock(&odd_alarm_mutex);
-		}
-	}
-}
-
-/*display_thread_2 start routine for handling even requests*/
-void *display_thread_2_r (void *arg)
-{
-	alarm_t *current_alarm;
-	alarm_t *next;
-	/*requested amount of seconds */
-	int req_seconds;
-	/*alarm number */
-	int req_num; 
-	/*Alarm message */
-	int alarm_time;
-	/* message */
-	char *str;
-	
-	/* timestamp to keep track of every 2 seconds */
-	int prev_timestamp;
-	
-	while(1)
-	{
-
-		
-		if(even_alarm_list != NULL) /*only if list is not empty */
-		{
-			/*lock odd alarm mutex so it can be modified without race conditions, etc...*/
-			pthread_mutex_lock(&even_alarm_mutex);
-			int now = time (NULL);
-			
+			//count down the earliest alarm, most urgent class on a tie
+			next = NULL;
+			for(class = 0; class < PRIORITY_CLASSES; class++)
+				if(shard->list[class] != NULL && (next == NULL || shard->list[class]->time < next->time))
+					next = shard->list[class];
 			
 			//new request
-			if(current_alarm != even_alarm_list)//Checking for new request
+			if(current_alarm != next)//Checking for new request
 			{
 				/*get first node */
-				current_alarm = even_alarm_list;
-				/* running number of seconds left (diminishing)*/
-				req_seconds = current_alarm->seconds;
-				/*alarm number */
-				req_num = current_alarm->request_num;
-				/*time of request */
-				alarm_time = current_alarm->time;
-				/*Alarm message */
-				str = current_alarm->message;
+				current_alarm = next;
 				
 				/*timestamp to keep track of every two seconds*/
 				prev_timestamp = now;
 				
+				
 					
 					//DEBUGGING
 			#ifdef DEBUG
-            printf ("[even list: ");
-            for (next = even_alarm_list; next != NULL; next = next->link)
+			for(class = 0; class < PRIORITY_CLASSES; class++)
+			{
+            printf ("[shard %d list %d: ", index + 1, class);
+            for (next = shard->list[class]; next != NULL; next = next->link)
                 printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - now, next->message);
+                    next->time - now, message_text (next->message));
             printf ("]\n");
+			}
 			#endif
 			}	
 			
 			/* Repeat every two seconds while alarm hasn't expired */
 			if(current_alarm->time - now > 0 && now - prev_timestamp >= 2)
 			{
-				fprintf(stdout,"Display Thread 2: Number of Seconds Left %d : Alarm Request Number: (%d) Alarm Request: (%d) [\"%s\"]\n",
-					current_alarm->time - now, req_num, req_seconds, str);
+				fprintf(stdout,"Display Thread %d: Number of Seconds Left %d : Alarm Request Number: (%d) Alarm Request: (%d) [\"%s\"]\n",
+					index + 1, current_alarm->time - now, current_alarm->request_num,
+					current_alarm->seconds, message_text (current_alarm->message));
 				
 				/*reset timestamp */
 				prev_timestamp = now;
 			}
-			else if(current_alarm->time - now < 0) //Alarm expired
-			{
-				fprintf(stdout,"Display Thread 2: Alarm Expired at %d : Alarm Request Number: (%d) Alarm Request: (%d) [\"%s\"]\n",
-					time (NULL), req_num, req_seconds, str);
-				printf ("(%d) %s\n", req_seconds, str); /*print alarm after expired */
-				
-				/* remove first node */
-				even_alarm_list = current_alarm->link;
-				//free(current_alarm);
-			}
 			
-			/* unlock to allow items to be added to odd list */
-				pthread_mutex_unlock(&even_alarm_mutex);
+			/* unlock to allow items to be added to the shard */
+				pthread_mutex_unlock(&shard->mutex);
+			/* nothing was due -- let the alarm thread hand over more work */
+			trace_yield (TRACE_YIELD);
 		}
 	}
 }
@@ -387,120 +1324,140 @@ int main (int argc, char *argv[])
 {
     int status;
     char line[128];
-    alarm_t *alarm, *last, *next;
+    char message[65];
+    int seconds, priority, now;
+    alarm_t *alarm;
     pthread_t thread;
-	/* display threads */
-	pthread_t display_thread_1, display_thread_2;
+	pthread_attr_t attr;
+	struct timespec start, end; /* submission latency */
+	/* display shard */
+	int index;
 	/* number of requested alarm, positive*/
 	uint32_t Alarm_Request_Number = 0;
+	int arg;
+	unsigned long distinct;
+	unsigned long bench_count = 0;
+	uint32_t interned;
 	
+	time_base = time (NULL);
+	if (argc > 2 && strcmp (argv[1], "-m") == 0) {
+		distinct = argc > 3 ? strtoul (argv[3], NULL, 0) : 1000;
+		if (distinct == 0) {
+			fprintf (stderr, "%s: -m needs at least one distinct message\n", argv[0]);
+			exit (1);
+		}
+		memory_bench (strtoul (argv[2], NULL, 0), distinct);
+		exit (0);
+	}
+	for (arg = 1; arg < argc; arg++) {
+		if (strcmp (argv[arg], "-p") == 0) {
+			pin_threads = 1;
+			placement_init();
+		} else if (strcmp (argv[arg], "-l") == 0 && arg + 1 < argc)
+			admit_pending = strtoul (argv[++arg], NULL, 0);
+		else if (strcmp (argv[arg], "-q") == 0 && arg + 1 < argc)
+			bench_count = strtoul (argv[++arg], NULL, 0);
+		else if (strcmp (argv[arg], "-t") == 0 && arg + 1 < argc)
+			trace_file = argv[++arg];
+		else if (strcmp (argv[arg], "-b") == 0 && arg + 1 < argc)
+			admit_backlog = strtoul (argv[++arg], NULL, 0);
+		else if (strcmp (argv[arg], "-a") == 0 && arg + 1 < argc
+			&& strcmp (argv[arg + 1], "block") == 0)
+			admit_policy = ADMIT_BLOCK, arg++;
+		else if (strcmp (argv[arg], "-a") == 0 && arg + 1 < argc
+			&& strcmp (argv[arg + 1], "reject") == 0)
+			admit_policy = ADMIT_REJECT, arg++;
+		else if (strcmp (argv[arg], "-a") == 0 && arg + 1 < argc
+			&& strcmp (argv[arg + 1], "shed") == 0)
+			admit_policy = ADMIT_SHED, arg++;
+		else {
+			fprintf (stderr, "Usage: %s [-p] [-l pending] [-b backlog] [-a block|reject|shed] [-t file] [-q count]\n"
+				"       %s -m count [distinct]\n", argv[0], argv[0]);
+			exit (1);
+		}
+	}
+	/*
+	 * Every shard mutex is set up before any thread starts: the alarm
+	 * thread's shard_scale may lock all SHARDS_MAX of them.
+	 */
+	for (index = 0; index < SHARDS_MAX; index++) {
+		status = pthread_mutex_init (&shards[index].mutex, NULL);
+		if (status != 0)
+			err_abort (status, "Init shard mutex");
+	}
+	status = pthread_attr_init (&attr);
+	if (status != 0)
+		err_abort (status, "Init thread attributes");
+
 	/*new alarm thread*/
-    status = pthread_create (
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
-	/*new display thread 1*/
 	status = pthread_create (
-        &display_thread_1, NULL, display_thread_1_r, NULL);
-    if (status != 0)
-        err_abort (status, "Create display_thread_1");
-	/*new display thread 2*/
-	status = pthread_create (
-        &display_thread_2, NULL, display_thread_2_r, NULL);
-    if (status != 0)
-        err_abort (status, "Create display_thread_2");
+		&thread, placement_attr (&attr, 0), alarm_thread, NULL);
+	if (status != 0)
+		err_abort (status, "Create alarm thread");
+	/*new display threads*/
+	for (index = 0; index < SHARDS_MIN; index++)
+		shard_start (index);
+	pthread_attr_destroy (&attr);
+	trace_thread (TRACE_MAIN, "main");
 	
+	if (bench_count > 0) {
+		latency_bench (bench_count);
+		exit (0);
+	}
+
 	/* Main loop */
     while (1) {
 		//User input
         printf ("alarm> \n");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+			/* let the alarm thread print the last receipts */
+			while (atomic_load(&staged_alarms) > 0)
+				sched_yield ();
+			stats_print();
+			trace_write();
+			exit (0);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
         if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+		if (strcmp (line, "stats\n") == 0) {
+			stats_print();
+			continue;
+		}
 
         /*
          * Parse input line into seconds (%d) and a message
          * (%64[^\n]), consisting of up to 64 characters
          * separated from the seconds by whitespace.
          */
-        if (sscanf (line, "%d %64[^\n]", 
-            &alarm->seconds, alarm->message) < 2 || alarm->seconds < 0) {
+		priority = PRIORITY_NORMAL;
+		/* the deadline has to fit alarm_t.time */
+		now = clock_rel ();
+        if ((sscanf (line, "Priority(%d) %d %64[^\n]", &priority, &seconds, message) < 3
+			&& sscanf (line, "%d %64[^\n]", &seconds, message) < 2)
+			|| seconds < 0 || seconds > INT32_MAX - now
+			|| priority < 0 || priority >= PRIORITY_CLASSES) {
             fprintf (stderr, "Bad command\n");
-            free (alarm);
+        } else if ((interned = message_intern (message)) == MESSAGE_NONE) {
+            fprintf (stderr, "Rejected Alarm Request: (%d) [\"%s\"] -- too many distinct messages\n",
+				seconds, message);
+        } else if (!admit (priority)) {
+			message_release (interned);
+            fprintf (stderr, "Rejected Alarm Request: (%d) [\"%s\"] -- too many pending alarms\n",
+				seconds, message);
         } else {
-            status = pthread_mutex_lock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
-            alarm->time = time (NULL) + alarm->seconds;
+            alarm = alarm_alloc ();
+            alarm->seconds = seconds;
+            alarm->priority = priority;
+            alarm->message = interned;
+            alarm->time = now + alarm->seconds;
 			
 			Alarm_Request_Number++; /*increment alarm request counter*/
 			alarm->request_num = Alarm_Request_Number; /*Set request number of the current alarm*/
-			fprintf(stdout, "Main Thread Received Alarm Request Number:(%d) Alarm Request: (%d) [\"%s\"]\n",
-				Alarm_Request_Number, alarm->seconds, alarm->message );
-			
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
-             */
-			last = NULL;
-			next = alarm_list;
-			if(next == NULL)//first entry into list
-			{
-				alarm_list = alarm;
-				alarm->link = NULL;
-			}
-			else
-			{
-				while(next != NULL)//iterate through list
-				{
-					//insert before smallest time that's still larger than alarm.time
-					if(alarm->time <= next->time)
-					{
-						alarm->link = next;
-						if(last != NULL)
-							last->link = alarm;
-						else
-							alarm_list = alarm;
-						
-						break;
-					}
-				last = next;
-				next = next->link;//iterate
-				
-				}
-				if(next == NULL)
-				{
-					last->link = alarm;
-				}
-			}
-			
-			
-#ifdef DEBUG
-            printf ("[list: ");
-            for (next = alarm_list; next != NULL; next = next->link)
-                printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - time (NULL), next->message);
-            printf ("]\n");
-#endif
-#ifdef DEBUG
-            printf ("[odd list: ");
-            for (next = odd_alarm_list; next != NULL; next = next->link)
-                printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - time (NULL), next->message);
-            printf ("]\n");
-			#endif
-			#ifdef DEBUG
-            printf ("[even list: ");
-            for (next = even_alarm_list; next != NULL; next = next->link)
-                printf ("%d(%d)[\"%s\"] ", next->time,
-                    next->time - time (NULL), next->message);
-            printf ("]\n");
-			#endif
-            status = pthread_mutex_unlock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+			submit (alarm);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			latency_record(&start, &end);
+			trace_record(TRACE_SUBMIT, end.tv_sec * 1000000000ULL + end.tv_nsec,
+				end.tv_sec * 1000000000ULL + end.tv_nsec, 0, Alarm_Request_Number);
         }
     }
 }
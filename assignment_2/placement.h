@@ -0,0 +1,116 @@
+#ifndef __placement_h
+#define __placement_h
+
+/*
+ * Thread placement, shared by the alarm programs. Define _GNU_SOURCE
+ * before including it, for the thread affinity calls.
+ *
+ * When started with "-p", each worker thread is pinned to a core of
+ * its own, and all of them (and main) are kept on one NUMA node so
+ * the lists they hand alarms through stay in that node's caches and
+ * memory. Nodes are read from sysfs; the node with the most CPUs we
+ * are allowed to run on is used. Without sysfs, every allowed CPU
+ * is treated as one node.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include "errors.h"
+
+static int pin_threads = 0;
+static int place_node = 0;
+static int place_cpus[CPU_SETSIZE];
+static int place_count = 0;
+
+/*
+ * Parse a sysfs CPU list such as "0-3,8-11" into a cpu set.
+ */
+static void cpulist_parse (const char *list, cpu_set_t *set)
+{
+	int lo, hi, n;
+
+	CPU_ZERO(set);
+	while (sscanf(list, "%d%n", &lo, &n) == 1)
+	{
+		list += n;
+		hi = lo;
+		if (*list == '-' && sscanf(list + 1, "%d%n", &hi, &n) == 1)
+			list += n + 1;
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (*list != ',')
+			break;
+		list++;
+	}
+}
+
+/*
+ * Choose the node and the cores that pinned threads will use.
+ */
+static void placement_init (void)
+{
+	cpu_set_t allowed, node_set, best_set;
+	char path[64], list[1024];
+	FILE *file;
+	int node, cpu, best, index;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		errno_abort("Get affinity");
+	best_set = allowed;
+	best = -1;
+	for (node = 0; ; node++)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		file = fopen(path, "r");
+		if (file == NULL)
+			break;
+		if (fgets(list, sizeof(list), file) != NULL)
+		{
+			cpulist_parse(list, &node_set);
+			CPU_AND(&node_set, &node_set, &allowed);
+			if (CPU_COUNT(&node_set) > best)
+			{
+				best = CPU_COUNT(&node_set);
+				best_set = node_set;
+				place_node = node;
+			}
+		}
+		fclose(file);
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &best_set))
+			place_cpus[place_count++] = cpu;
+
+	/* main may run anywhere on the chosen node */
+	if (sched_setaffinity(0, sizeof(best_set), &best_set) != 0)
+		errno_abort("Set affinity");
+	/* the alarm thread is worker 0, display threads follow */
+	fprintf(stderr, "Placement: node %d, worker n on cpu list[n %% %d], list", place_node, place_count);
+	for (index = 0; index < place_count; index++)
+		fprintf(stderr, "%s%d", index == 0 ? " " : ",", place_cpus[index]);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Point the (initialized) attributes at the core for worker number
+ * "worker" when placement is on. Returns the attributes to pass to
+ * pthread_create (NULL for the defaults). Nothing is printed here:
+ * placement_init has reported which core each worker gets, and a
+ * program may start a thread per alarm.
+ */
+static pthread_attr_t *placement_attr (pthread_attr_t *attr, int worker)
+{
+	cpu_set_t set;
+	int status, cpu;
+
+	if (!pin_threads)
+		return NULL;
+	cpu = place_cpus[worker % place_count];
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	status = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	if (status != 0)
+		err_abort(status, "Set thread affinity");
+	return attr;
+}
+
+#endif
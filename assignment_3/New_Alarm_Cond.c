@@ -9,11 +9,38 @@
  * enters an earlier timeout, it signals the condition variable
  * so that the alarm thread will wake up and process the earlier
  * timeout first, requeueing the later request.
+ *
+ * Run with "-p" to pin the alarm thread and the display threads to
+ * cores of a single NUMA node.
+ *
+ * Run with "-s <name>" to put the alarm table in the POSIX shared
+ * memory object <name> and serve it, and with "-c <name>" to submit
+ * and cancel alarms in a table served by another process (see
+ * queue_open). "-n <count>" sets how many alarms the table holds.
+ *
+ * "Status" (or "List") prints every pending alarm with the time it
+ * has left, from a snapshot that doesn't hold up the other threads
+ * (see alarm_snapshot).
+ *
+ * Run with "-r <file>" to record every accepted command in <file>
+ * with the time it arrived, for replay.c to play back.
+ *
+ * Run with "-w" to print, at end of input, how many times the alarm
+ * thread was signalled and how many of those wakeups found nothing
+ * new (see alarm_wake).
  */
+#define _GNU_SOURCE /* for thread affinity */
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
-#include <semaphore.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <signal.h>
 #include "errors.h"
+#include "placement.h"
 
 #define DEBUG
 
@@ -25,21 +52,263 @@
  * been on the list.
  */
 typedef struct alarm_tag {
-    struct alarm_tag    *link;
+    int                 link;   /* index of next alarm, or NIL */
     int                 seconds;
     time_t              time;   /* seconds from EPOCH */
     char                message[128];
 	int 				num;
-	int					isCancel;
+	int					display;//display thread created
+	atomic_int			born;	//table version that inserted it
+	atomic_int			died;	//table version that removed it, 0 while pending
 } alarm_t;
 
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
+/*
+ * The alarm table. Alarms live in an array of slots and are linked
+ * by index rather than by pointer, so that the whole table, with its
+ * locks, can be mapped into several processes at different
+ * addresses. Slots that have never been used are handed out from
+ * "used"; freed ones go on free_list. alarm_list and free_list are
+ * protected by list_mutex.
+ *
+ * The array never moves, so its size is fixed when the table is
+ * made: QUEUE_ALARMS slots for a shared table, and QUEUE_PRIVATE
+ * for one private to this process, or the count given with "-n".
+ * Memory is only committed as slots are first used, so a large
+ * table costs address space, not memory.
+ */
+#define QUEUE_ALARMS	65536
+#define QUEUE_PRIVATE	(1 << 24)
+#define SNAPSHOTS		64		/* snapshots taken at once */
+#define NIL				(-1)
+#define ALARM(index)	(&queue->alarms[index])
+
+typedef struct queue_tag {
+	pthread_mutex_t		alarm_mutex;	/* process-shared, robust */
+	pthread_cond_t		alarm_cond;		/* process-shared */
+	pthread_mutex_t		list_mutex;		/* process-shared, robust */
+	int					size;			/* slots in alarms */
+	int					alarm_list;		/* sorted by message number */
+	int					free_list;		/* oldest freed first */
+	int					free_tail;
+	int					used;
+	/*
+	 * Versions for snapshots. Every change to the list bumps
+	 * version (under list_mutex) and stamps the alarms it inserts or
+	 * removes with it. Each snapshot in progress registers the
+	 * version it is of, and a freed slot is only reused once it died
+	 * no later than the oldest of them, so a reader can tell from
+	 * the stamps alone which alarms were pending at its version.
+	 */
+	int					version;
+	atomic_int			snapshot_version[SNAPSHOTS];	/* -1 if unused */
+	pid_t				snapshot_pid[SNAPSHOTS];
+	/*
+	 * Wakeup bookkeeping. list_version counts inserts (under list_mutex),
+	 * seen_version is the last one the alarm thread has scanned, and
+	 * wake_pending says a signal is already on its way. All but
+	 * list_version are protected by alarm_mutex.
+	 */
+	int					list_version;
+	int					seen_version;
+	int					wake_pending;
+	unsigned long		wake_signals;	//signals sent
+	unsigned long		wake_spurious;	//wakeups that found nothing new
+	alarm_t				alarms[];
+} queue_t;
+
+queue_t *queue;
 time_t current_alarm = 0;
-sem_t sem_w;
-sem_t sem_r;
-int read_counter = 0;//may not need
+int wake_stats = 0;
+
+/*
+ * Map the alarm table, with room for "size" alarms (0 for the
+ * default). With no name it is private to this process. Otherwise it
+ * is the shared memory object "name", created and initialized if
+ * "create" is set (the serving process), or attached as it is, at
+ * the size it was made (a client). Both of the table's mutexes are
+ * robust, so a client that dies holding one doesn't wedge the
+ * others.
+ */
+void queue_open (const char *name, int create, int size)
+{
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	struct stat stat;
+	size_t length;
+	int fd, status, index;
+
+	if (size <= 0)
+		size = name == NULL ? QUEUE_PRIVATE : QUEUE_ALARMS;
+	length = sizeof(queue_t) + (size_t)size * sizeof(alarm_t);
+	if (name == NULL)
+		queue = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	else
+	{
+		fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+		if (fd == -1)
+			errno_abort("Open shared alarm table");
+		if (create && ftruncate(fd, length) == -1)
+			errno_abort("Size shared alarm table");
+		if (!create)
+		{
+			if (fstat(fd, &stat) == -1)
+				errno_abort("Size shared alarm table");
+			length = stat.st_size;
+		}
+		queue = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, fd, 0);
+		close(fd);
+	}
+	if (queue == MAP_FAILED)
+		errno_abort("Map alarm table");
+	if (name != NULL && !create)
+		return;
+
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+	status = pthread_mutex_init(&queue->alarm_mutex, &mutex_attr);
+	if (status != 0)
+		err_abort(status, "Init mutex");
+	status = pthread_mutex_init(&queue->list_mutex, &mutex_attr);
+	if (status != 0)
+		err_abort(status, "Init mutex");
+	pthread_mutexattr_destroy(&mutex_attr);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	status = pthread_cond_init(&queue->alarm_cond, &cond_attr);
+	if (status != 0)
+		err_abort(status, "Init cond");
+	pthread_condattr_destroy(&cond_attr);
+	queue->size = size;
+	queue->alarm_list = NIL;
+	queue->free_list = NIL;
+	queue->free_tail = NIL;
+	queue->used = 0;
+	queue->version = 0;
+	for (index = 0; index < SNAPSHOTS; index++)
+		atomic_init(&queue->snapshot_version[index], -1);
+	queue->list_version = 0;
+	queue->seen_version = 0;
+	queue->wake_pending = 0;
+	queue->wake_signals = 0;
+	queue->wake_spurious = 0;
+}
+
+/*
+ * Lock alarm_mutex. If its owner died holding it, the table is still
+ * consistent -- alarm_mutex only guards the wakeup bookkeeping -- so
+ * just mark the mutex usable again.
+ */
+void queue_lock (void)
+{
+	int status;
+
+	status = pthread_mutex_lock(&queue->alarm_mutex);
+	if (status == EOWNERDEAD)
+		status = pthread_mutex_consistent(&queue->alarm_mutex);
+	if (status != 0)
+		err_abort(status, "Lock mutex");
+}
+
+/*
+ * Lock list_mutex. Every change to alarm_list and free_list is
+ * ordered so that both are well formed after each store: a slot is
+ * filled in before it is linked, and unlinked before it is freed.
+ * An owner that died part way through can therefore at worst have
+ * leaked a few slots, and the mutex is just marked usable again.
+ */
+void list_lock (void)
+{
+	int status;
+
+	status = pthread_mutex_lock(&queue->list_mutex);
+	if (status == EOWNERDEAD)
+		status = pthread_mutex_consistent(&queue->list_mutex);
+	if (status != 0)
+		err_abort(status, "Lock mutex");
+}
+
+void list_unlock (void)
+{
+	int status;
+
+	status = pthread_mutex_unlock(&queue->list_mutex);
+	if (status != 0)
+		err_abort(status, "Unlock mutex");
+}
+
+/*
+ * Return the version of the oldest snapshot in progress, or INT_MAX
+ * if there is none. A snapshot whose process has gone away is
+ * dropped. The caller must hold list_mutex.
+ */
+int snapshot_oldest (void)
+{
+	int slot, version, oldest;
+
+	oldest = INT_MAX;
+	for (slot = 0; slot < SNAPSHOTS; slot++)
+	{
+		version = atomic_load(&queue->snapshot_version[slot]);
+		if (version < 0)
+			continue;
+		if (kill(queue->snapshot_pid[slot], 0) == -1 && errno == ESRCH)
+			atomic_store(&queue->snapshot_version[slot], -1);
+		else if (version < oldest)
+			oldest = version;
+	}
+	return oldest;
+}
+
+/*
+ * Take a free slot, or return NIL if the table is full. The free
+ * list is oldest first, and its head is reused unless a snapshot in
+ * progress is of a version from before that slot died; then a slot
+ * that has never been used is taken instead. The slot is marked as
+ * not born yet, so snapshots skip it until it is inserted.
+ * The caller must hold list_mutex.
+ */
+int alarm_alloc (void)
+{
+	int index;
+
+	index = queue->free_list;
+	if (index != NIL && atomic_load(&ALARM(index)->died) <= snapshot_oldest())
+	{
+		if (ALARM(index)->link == NIL)
+			queue->free_tail = NIL;
+		queue->free_list = ALARM(index)->link;
+	}
+	else if (queue->used < queue->size)
+		index = queue->used++;
+	else
+		index = NIL;
+	if (index != NIL)
+		atomic_store(&ALARM(index)->born, INT_MAX);
+	return index;
+}
+
+/*
+ * Put a chain of alarms linked through "link" on the tail of the
+ * free list. The caller must hold list_mutex.
+ */
+void alarm_free (int index)
+{
+	int next;
+
+	for (; index != NIL; index = next)
+	{
+		next = ALARM(index)->link;
+		ALARM(index)->link = NIL;
+		if (queue->free_tail == NIL)
+			queue->free_list = index;
+		else
+			ALARM(queue->free_tail)->link = index;
+		queue->free_tail = index;
+	}
+}
 
 
 
@@ -50,33 +319,41 @@ void *periodic_display_thread(void *arg)
 /*
  * Insert alarm entry on list, in order.
  */
-void alarm_insert (alarm_t *alarm)
+void alarm_insert (int index)
 {
-    int status;
-    alarm_t **last, *next;
+    alarm_t *alarm, *next;
+    int *last, replaced;
 
     /*
      * LOCKING PROTOCOL:
      * 
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
+     * This routine requires that the caller have locked
+     * list_mutex!
      */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
+    alarm = ALARM(index);
+    atomic_store(&alarm->born, ++queue->version);
+    atomic_store(&alarm->died, 0);
+    last = &queue->alarm_list;
+    next = NULL;
+    while (*last != NIL) {
+        next = ALARM(*last);
         if (next->num > alarm->num) {
-            alarm->link = next;
-            *last = alarm;
+            alarm->link = *last;
+            *last = index;
             break;
         }
 		else if (next->num == alarm->num)
 		{
+			replaced = *last;
 			alarm->link = next->link;
-			*last = alarm;
+			*last = index;
+			next->link = NIL;
+			atomic_store(&next->died, queue->version);
+			alarm_free(replaced);
 			break;
 		}
         last = &next->link;
-        next = next->link;
+        next = NULL;
     }
     /*
      * If we reached the end of the list, insert the new alarm
@@ -84,32 +361,198 @@ void alarm_insert (alarm_t *alarm)
      * field of the last item, or to the list header.)
      */
     if (next == NULL) {
-        *last = alarm;
-        alarm->link = NULL;
+        *last = index;
+        alarm->link = NIL;
     }
+	queue->list_version++;
 #ifdef DEBUG
     printf ("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
+    for (index = queue->alarm_list; index != NIL; index = next->link) {
+        next = ALARM(index);
         printf ("%d(%d)[\"%s\"] ", next->time,
             next->time - time (NULL), next->message);
+    }
     printf ("]\n");
 #endif
-    /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
-     *
-    if (current_alarm == 0 || alarm->time < current_alarm) {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal (&alarm_cond);
-        if (status != 0)
-            err_abort (status, "Signal cond");
-    }*/
-	//wake after insert
-	status = pthread_cond_signal(&alarm_cond);
+}
+
+/*
+ * Wake the alarm thread after the insert that made the list reach
+ * version, unless it has already scanned that version or a wakeup
+ * is already pending. A burst of inserts then costs one wakeup, and
+ * an insert the thread picked up on its own costs none.
+ *
+ * The alarm thread holds alarm_mutex while it scans the list, and
+ * takes list_mutex under it, so this must be called after
+ * list_mutex has been released.
+ */
+void alarm_wake (int version)
+{
+	int status;
+
+	queue_lock();
+	if (version - queue->seen_version > 0 && !queue->wake_pending)
+	{
+		queue->wake_pending = 1;
+		queue->wake_signals++;
+		status = pthread_cond_signal(&queue->alarm_cond);
+		if (status != 0)
+			err_abort(status, "Signal cond");
+	}
+	status = pthread_mutex_unlock(&queue->alarm_mutex);
 	if (status != 0)
-		err_abort(status, "Signal cond");
+		err_abort(status, "Unlock mutex");
+}
+
+/*
+ * Cancel every alarm whose number is in [lo, hi] and, if prefix is
+ * not NULL, whose message starts with prefix.
+ *
+ * The list is sorted by message number, so this is one pass that
+ * stops at the first alarm past hi. Matching alarms are unlinked
+ * onto a local chain while list_mutex is held, and are only reported
+ * once the lock has been released; the chain is then freed in one
+ * more short write section.
+ */
+int alarm_cancel (int lo, int hi, const char *prefix)
+{
+	int count, index, cancelled, *last, *tail, version;
+	alarm_t *next;
+	size_t len;
+
+	len = prefix == NULL ? 0 : strlen(prefix);
+	cancelled = NIL;
+	tail = &cancelled;
+	count = 0;
+
+	list_lock();
+	last = &queue->alarm_list;
+	version = queue->version + 1;
+	while (*last != NIL && ALARM(*last)->num <= hi)
+	{
+		index = *last;
+		next = ALARM(index);
+		if (next->num >= lo
+			&& (prefix == NULL || strncmp(next->message, prefix, len) == 0))
+		{
+			atomic_store(&next->died, version);
+			*last = next->link;
+			*tail = index;
+			tail = &next->link;
+			count++;
+		}
+		else
+			last = &next->link;
+	}
+	*tail = NIL;
+	if (count > 0)
+		queue->version = version;
+	list_unlock();
+
+	if (cancelled == NIL)
+		return 0;
+	for (index = cancelled; index != NIL; index = ALARM(index)->link)
+		printf("CANCEL: Message(%d) %s\n", ALARM(index)->num, ALARM(index)->message);
+	list_lock();
+	alarm_free(cancelled);
+	list_unlock();
+	return count;
+}
+
+/*
+ * A pending alarm as seen by a snapshot.
+ */
+typedef struct status_tag {
+	int					num;
+	int					seconds;
+	time_t				time;
+	char				message[128];
+} status_t;
+
+int status_compare (const void *a, const void *b)
+{
+	return ((const status_t*)a)->num - ((const status_t*)b)->num;
+}
+
+/*
+ * Copy every alarm that was pending at the current table version
+ * into a new array, sorted by message number, and return how many
+ * there are. *version and *now are set to the version and time the
+ * snapshot is of.
+ *
+ * list_mutex is only held long enough to read the version and register
+ * the snapshot; the table itself is read while inserts, cancels and
+ * expiries go on. An alarm was pending at version v if it was born
+ * by v and hasn't died, or died after v. Such a slot can't be reused
+ * until the snapshot is over (see alarm_alloc), so its stamps and
+ * contents stay put; a slot that is reused meanwhile died by v, or
+ * reads as born after v. died is read before born, the opposite of
+ * the order alarm_insert writes them in. The caller frees the array.
+ */
+int alarm_snapshot (status_t **snapshot, int *version, time_t *now)
+{
+	int used, index, count, died, slot;
+	alarm_t *alarm;
+	status_t *copy;
+
+	while (1)
+	{
+		list_lock();
+		for (slot = 0; slot < SNAPSHOTS; slot++)
+			if (atomic_load(&queue->snapshot_version[slot]) < 0)
+				break;
+		if (slot < SNAPSHOTS)
+			break;
+		/* every registration is taken; wait for one to finish */
+		list_unlock();
+		sched_yield();
+	}
+	*version = queue->version;
+	used = queue->used;
+	queue->snapshot_pid[slot] = getpid();
+	atomic_store(&queue->snapshot_version[slot], *version);
+	*now = time(NULL);
+	list_unlock();
+
+	copy = (status_t*)malloc((used > 0 ? used : 1) * sizeof(status_t));
+	if (copy == NULL)
+		errno_abort("Allocate snapshot");
+	count = 0;
+	for (index = 0; index < used; index++)
+	{
+		alarm = ALARM(index);
+		died = atomic_load(&alarm->died);
+		if ((died != 0 && died <= *version)
+			|| atomic_load(&alarm->born) > *version)
+			continue;
+		copy[count].num = alarm->num;
+		copy[count].seconds = alarm->seconds;
+		copy[count].time = alarm->time;
+		strcpy(copy[count].message, alarm->message);
+		count++;
+	}
+	atomic_store(&queue->snapshot_version[slot], -1);
+
+	qsort(copy, count, sizeof(status_t), status_compare);
+	*snapshot = copy;
+	return count;
+}
+
+/*
+ * The "Status" command.
+ */
+void alarm_status (void)
+{
+	status_t *snapshot;
+	int count, version, index;
+	time_t now;
+
+	count = alarm_snapshot(&snapshot, &version, &now);
+	printf("STATUS: %d pending alarms at version %d\n", count, version);
+	for (index = 0; index < count; index++)
+		printf("Message(%d) %s: %ld seconds left\n", snapshot[index].num,
+			snapshot[index].message, (long)(snapshot[index].time - now));
+	free(snapshot);
 }
 
 /*
@@ -117,197 +560,312 @@ void alarm_insert (alarm_t *alarm)
  */
 void *alarm_thread (void *arg)
 {
-    alarm_t *alarm;
+    alarm_t *alarm, *next;
     struct timespec cond_time;
     time_t now;
-    int status, expired;
+    int status, index, expired, *last;
 	pthread_t display_thread;
+	pthread_attr_t attr;
+	int display_count = 0;
+	int signalled = 0;
+	int created;
+
+	status = pthread_attr_init(&attr);
+	if (status != 0)
+		err_abort(status, "Init thread attributes");
 
     /*
      * Loop forever, processing commands. The alarm thread will
      * be disintegrated when the process exits. Lock the mutex
      * at the start -- it will be unlocked during condition
-     * waits, so the main thread can insert alarms.
+     * waits, so the main thread can wake us.
+     *
+     * Alarms stay on the list until they expire, so that the main
+     * thread can cancel them at any time. The thread only reads
+     * the list to find the earliest expiration time, and takes the
+     * write lock when there is something to remove.
      */
-    
+    queue_lock ();
 
-	//start read
     while (1) {
-		//status = pthread_mutex_lock (&alarm_mutex);
-		status = sem_wait(&sem_r);//to read
-		read_counter++;
-		if (read_counter == 1)
-		{
-			sem_wait(&sem_w);
-		}
-		sem_post(&sem_r);
-		/*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
-         */
-        current_alarm = 0;
-        //while (alarm_list == NULL) {
-            status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Wait on cond");
-            }
-		//get new element?
-        alarm = alarm_list;//first element
-		//done reading
-		sem_wait(&sem_r);
-		read_counter--;
-
-		if (read_counter == 0)
-		{
-			sem_post(&sem_w);
-		}
-		sem_post(&sem_r);
-
-		//write
-		sem_wait(&sem_w);
-
-		//remove first element
-		alarm_list = alarm->link;
+		list_lock();
 
-		//printf("iscanc: %d, num: %d, mes:%s", alarm->isCancel, alarm->num, alarm->message);
-		if (alarm->isCancel == 0)//normal request
+		//find earliest alarm, creating display threads for new ones
+		alarm = NULL;
+		created = 0;
+		for (index = queue->alarm_list; index != NIL; index = next->link)
 		{
-			//create display thread upon new list entry
-			status = pthread_create(
-				&display_thread, NULL, periodic_display_thread, NULL);
-			if (status != 0)
-				err_abort(status, "Create alarm thread");
-			printf("DISPLAY THREAD CREATED FOR : Message(%d) %s\n", alarm->num, alarm->message);
-		}
-		else//cancel message
-		{
-
-			//find alarm to cancel
-			alarm_t *next, *last;
-			next = alarm_list;
-			last = NULL;
-			while (next != NULL)
+			next = ALARM(index);
+			if (!next->display)
 			{
-				if (!next->isCancel && next->num == alarm->num)
-				{
-					//cancel
-					//remove from list
-					if (last == NULL)
-					{
-						alarm_list = next->link;
-					}
-					else
-					{
-						last->link = next->link;
-					}
-					printf("CANCEL: Message(%d) %s", alarm->num, next->message);
-					break;
-				}
-				last = next;
-				next = next->link;
+				next->display = 1;
+				created++;
+				status = pthread_create(
+					&display_thread,
+					placement_attr(&attr, 1 + display_count++),
+					periodic_display_thread, NULL);
+				if (status != 0)
+					err_abort(status, "Create alarm thread");
+				printf("DISPLAY THREAD CREATED FOR : Message(%d) %s\n", next->num, next->message);
 			}
-
+			if (alarm == NULL || next->time < alarm->time)
+				alarm = next;
 		}
-		//done writing
-		sem_post(&sem_w);
+		/*
+		 * Setting current_alarm to 0 informs the insert
+		 * routine that the thread is not busy.
+		 */
+		if (signalled && created == 0
+			&& current_alarm == (alarm == NULL ? 0 : alarm->time))
+			queue->wake_spurious++;
+		current_alarm = alarm == NULL ? 0 : alarm->time;
+		queue->seen_version = queue->list_version;
+		queue->wake_pending = 0;
 
-        now = time (NULL);
-		expired = 0;
+		list_unlock();
 
-        if (alarm->time > now) {
+        now = time (NULL);
+        signalled = 0;
+        if (current_alarm == 0) {
+            status = pthread_cond_wait (&queue->alarm_cond, &queue->alarm_mutex);
+            if (status == EOWNERDEAD)
+                status = pthread_mutex_consistent (&queue->alarm_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on cond");
+            signalled = queue->wake_pending;
+            continue;
+        }
+        if (current_alarm > now) {
 #ifdef DEBUG
-            printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                alarm->time - time (NULL), alarm->message);
+            printf ("[waiting: %d(%d)]\n", current_alarm,
+                current_alarm - now);
 #endif
-            cond_time.tv_sec = alarm->time;
+            cond_time.tv_sec = current_alarm;
             cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-            while (current_alarm == alarm->time) {
-                status = pthread_cond_timedwait (
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT) {
-                    expired = 1;
-                    break;
-                }
+            status = pthread_cond_timedwait (
+                &queue->alarm_cond, &queue->alarm_mutex, &cond_time);
+            if (status == EOWNERDEAD)
+                status = pthread_mutex_consistent (&queue->alarm_mutex);
+            if (status != ETIMEDOUT) {
                 if (status != 0)
                     err_abort (status, "Cond timedwait");
+                signalled = queue->wake_pending;
+                continue;
             }
-            if (!expired)
-                alarm_insert (alarm);
-        } else
-            expired = 1;
-        if (expired) {
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
+            /*
+             * time() can lag the clock used for the timed wait by a
+             * few milliseconds, so trust the timeout rather than
+             * looking at the clock again.
+             */
+            now = current_alarm;
         }
+
+		//remove everything that has expired
+		list_lock();
+		expired = NIL;
+		last = &queue->alarm_list;
+		while ((index = *last) != NIL)
+		{
+			next = ALARM(index);
+			if (next->time <= now)
+			{
+				if (expired == NIL)
+					queue->version++;
+				atomic_store(&next->died, queue->version);
+				*last = next->link;
+				next->link = expired;
+				expired = index;
+			}
+			else
+				last = &next->link;
+		}
+		list_unlock();
+
+		if (expired == NIL)
+			continue;
+		for (index = expired; index != NIL; index = ALARM(index)->link)
+			printf ("(%d) %s\n", ALARM(index)->seconds, ALARM(index)->message);
+		list_lock();
+		alarm_free(expired);
+		list_unlock();
     }
 }
 
+/*
+ * Workload capture ("-r"). Only main writes to it.
+ */
+FILE *capture = NULL;
+struct timespec capture_start;
+
+/*
+ * Record an accepted command with the time it arrived, as
+ * "@<seconds> <command>".
+ */
+void capture_line (const char *line)
+{
+	struct timespec now;
+
+	if (capture == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(capture, "@%.6f %s", (now.tv_sec - capture_start.tv_sec)
+		+ (now.tv_nsec - capture_start.tv_nsec) / 1e9, line);
+}
+
 int main (int argc, char *argv[])
 {
     int status;
     char line[128];
-    alarm_t *alarm;
+    alarm_t alarm, *next;
     pthread_t thread;
+	pthread_attr_t attr;
 	int good_input = 0;
+	int lo, hi;
+	char prefix[128];
+	int version, index, arg;
+	const char *name = NULL;
+	int serve = 1;
+	int size = 0;
 
-	sem_init(&sem_w, 1, 1);//create writer semaphore
-	sem_init(&sem_r, 1, 1);//create reader semaphore for mutual exclusion
+	clock_gettime(CLOCK_MONOTONIC, &capture_start);
+	for (arg = 1; arg < argc; arg++)
+	{
+		if (strcmp(argv[arg], "-p") == 0)
+		{
+			pin_threads = 1;
+			placement_init();
+		}
+		else if (strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+			name = argv[++arg];
+		else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+		{
+			name = argv[++arg];
+			serve = 0;
+		}
+		else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc
+			&& (size = atoi(argv[++arg])) > 0)
+			;
+		else if (strcmp(argv[arg], "-w") == 0)
+			wake_stats = 1;
+		else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+		{
+			capture = fopen(argv[++arg], "w");
+			if (capture == NULL)
+				errno_abort("Open capture file");
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-p] [-w] [-n alarms] [-s name | -c name] [-r capture]\n", argv[0]);
+			exit(1);
+		}
+	}
+	queue_open(name, serve, size);
+
+	if (serve)
+	{
+		status = pthread_attr_init(&attr);
+		if (status != 0)
+			err_abort(status, "Init thread attributes");
 
-    status = pthread_create (
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
+		status = pthread_create (
+			&thread, placement_attr(&attr, 0), alarm_thread, NULL);
+		if (status != 0)
+			err_abort (status, "Create alarm thread");
+		pthread_attr_destroy(&attr);
+	}
     while (1) {
         printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
+        if (fgets (line, sizeof (line), stdin) == NULL)
+		{
+			if (wake_stats)
+			{
+				queue_lock();
+				fprintf(stderr, "[wakeups: %d inserts, %lu signalled, %lu spurious]\n",
+					queue->list_version, queue->wake_signals, queue->wake_spurious);
+				status = pthread_mutex_unlock(&queue->alarm_mutex);
+				if (status != 0)
+					err_abort(status, "Unlock mutex");
+			}
+			//clients can't attach once the server is gone
+			if (name != NULL && serve)
+				shm_unlink(name);
+			exit (0);
+		}
         if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+
+		if (strcmp(line, "Status\n") == 0 || strcmp(line, "List\n") == 0)
+		{
+			capture_line(line);
+			alarm_status();
+			continue;
+		}
+
+		/*
+		 * Cancel commands are applied directly to the list:
+		 *
+		 *   Cancel: Message(n)      one alarm
+		 *   Cancel: Message(a-b)    every alarm numbered a to b
+		 *   Cancel: Prefix(text)    every alarm whose message
+		 *                           starts with text
+		 */
+		if (sscanf(line, "Cancel: Message(%d-%d)", &lo, &hi) == 2
+			|| (sscanf(line, "Cancel: Message(%d)", &lo) == 1 && (hi = lo, 1)))
+		{
+			capture_line(line);
+			if (alarm_cancel(lo, hi, NULL) == 0)
+				fprintf(stderr, "No alarm to cancel\n");
+			continue;
+		}
+		if (sscanf(line, "Cancel: Prefix(%127[^)])", prefix) == 1)
+		{
+			capture_line(line);
+			if (alarm_cancel(INT_MIN, INT_MAX, prefix) == 0)
+				fprintf(stderr, "No alarm to cancel\n");
+			continue;
+		}
 
         /*
          * Parse input line into seconds (%d) and a message
          * (%64[^\n]), consisting of up to 64 characters
          * separated from the seconds by whitespace.
          */
-		if (sscanf(line, "%d Message(%d) %128[^\n]", &alarm->seconds, &alarm->num, alarm->message) == 3)
-		{
-			
-			alarm->isCancel = 0;
+		if (sscanf(line, "%d Message(%d) %127[^\n]", &alarm.seconds, &alarm.num, alarm.message) == 3)
 			good_input = 1;
-		}
-		else if (sscanf(line, "Cancel: Message(%d)[^\n]", &alarm->num) == 1)
-		{
-			alarm->isCancel = 1;
-			good_input = 1;
-		}
 		else
 		{
 			fprintf(stderr, "Bad command\n");
-			free(alarm);
 			good_input = 0;
 		}
 
 		if(good_input)
 		{
 			//add to list
-            //status = pthread_mutex_lock (&alarm_mutex);
-			status = sem_wait(&sem_w);//wait
-			if (status != 0)
-                err_abort (status, "Lock mutex");
+			list_lock();
 
-            alarm->time = time (NULL) + alarm->seconds; //time of expiry
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by message number.
-             */
-            alarm_insert (alarm);
-            //status = pthread_mutex_unlock (&alarm_mutex);
-			status = sem_post(&sem_w);//signal
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+			index = alarm_alloc();
+			if (index != NIL)
+			{
+				next = ALARM(index);
+				next->seconds = alarm.seconds;
+				next->num = alarm.num;
+				next->display = 0;
+				next->time = time (NULL) + alarm.seconds; //time of expiry
+				strcpy(next->message, alarm.message);
+				/*
+				 * Insert the new alarm into the list of alarms,
+				 * sorted by message number.
+				 */
+				alarm_insert (index);
+			}
+			version = queue->list_version;
+			list_unlock();
+			if (index == NIL)
+				fprintf(stderr, "Alarm table full\n");
+			else
+			{
+				capture_line(line);
+				alarm_wake (version);
+			}
         }
     }
 }
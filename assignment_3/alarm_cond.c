@@ -9,9 +9,36 @@
  * enters an earlier timeout, it signals the condition variable
  * so that the alarm thread will wake up and process the earlier
  * timeout first, requeueing the later request.
+ *
+ * A request of the form "Repeat <interval> [x<count>] <message>"
+ * creates a recurring alarm that fires every <interval> seconds,
+ * <count> times (or forever when no count is given). When it
+ * fires, the same alarm_t is re-armed in place rather than being
+ * freed and reallocated.
+ *
+ * A line may start with "@<seconds>", the time since the program
+ * started at which that line should take effect; main holds the
+ * line back until then. Run with "-v" to use a virtual clock
+ * instead of the real one (see clock_now), or "-e" to replace the
+ * alarm thread with an epoll event loop (see event_loop). With "-v",
+ * the run ends once input is over and the last one-shot or counted
+ * alarm has fired; alarms that repeat forever fire only up to then.
+ *
+ * Run with "-r <file>" to record every accepted command in <file>,
+ * stamped in the same "@" form (to the microsecond) with the time it
+ * arrived; replay.c plays such a capture back.
+ *
+ * Alarms are numbered from 1 in the order they are accepted, and
+ * "Snooze <number> <seconds>" pushes a pending alarm's deadline back
+ * by that many seconds, while "Reschedule <number> <seconds>" sets
+ * it to that many seconds from now. Either moves the alarm in place
+ * (see alarm_reschedule).
  */
 #include <pthread.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
 #include "errors.h"
 
 /*
@@ -23,15 +50,505 @@
  */
 typedef struct alarm_tag {
     struct alarm_tag    *link;
+    struct alarm_tag    *prev;      /* on a repeat list, NULL at its head */
+    struct alarm_tag    *number_link;   /* next in its number_hash bucket */
     int                 seconds;
     time_t              time;   /* seconds from EPOCH */
     char                message[64];
+    int                 interval;   /* 0 for a one-shot alarm */
+    int                 count;      /* firings left, 0 = forever */
+    int                 number;     /* for Snooze and Reschedule */
+    int                 slot;       /* index in alarm_heap, or SLOT_* */
 } alarm_t;
 
+#define SLOT_REPEAT     -1  /* on a repeat_t list, behind its head */
+#define SLOT_OFF        -2  /* taken off by the alarm thread */
+
+/*
+ * Pending alarms are kept in a binary min-heap, ordered by time and
+ * then by number: every one-shot alarm, plus the head of each
+ * recurring list (see repeat_t). Every alarm keeps its own index in
+ * the heap up to date, so one whose deadline changes can be moved up
+ * or down from where it is instead of being searched for.
+ */
+#define ALARM_BEFORE(a, b) ((a)->time < (b)->time \
+    || ((a)->time == (b)->time && (a)->number < (b)->number))
+
+/*
+ * Recurring alarms that share an interval are kept together on a
+ * FIFO list of their own. A re-armed alarm's next deadline is its
+ * previous deadline plus the interval, which is normally no earlier
+ * than anything already on that list, so it goes on the tail in
+ * constant time no matter how many recurring alarms are pending.
+ * Only a list's head is in the heap. The lists are found by interval
+ * through repeat_hash. A list is kept, even while it is empty, until
+ * the last alarm with its interval is freed, so firing and re-arming
+ * an alarm that is alone on its list allocates nothing.
+ */
+typedef struct repeat_tag {
+    struct repeat_tag   *link;      /* next in the same hash bucket */
+    int                 interval;
+    int                 alarms;     /* alarms with this interval, on the list or not */
+    alarm_t             *head;
+    alarm_t             *tail;
+} repeat_t;
+
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
+alarm_t **alarm_heap = NULL;
+int alarm_count = 0, alarm_size = 0;
+repeat_t **repeat_hash = NULL;
+int repeat_buckets = 0, repeat_lists = 0;
 time_t current_alarm = 0;
+alarm_t *alarm_held = NULL;     /* the alarm thread is waiting for it */
+
+/*
+ * Pending alarms by number, for Snooze and Reschedule. Numbers are
+ * never reused, but an alarm leaves the table when it is freed, so
+ * the table grows with the number of alarms pending rather than
+ * with every alarm ever accepted.
+ */
+alarm_t **number_hash = NULL;
+int number_buckets = 0, number_pending = 0, alarm_numbered = 0;
+
+/*
+ * The clock. Normally this is time(). With "-v" the program runs on
+ * a virtual clock instead: nothing sleeps, and whenever the alarm
+ * thread would wait for a deadline it moves the clock straight to
+ * it. The clock may only be moved up to virtual_horizon, the arrival
+ * time of the next input line, so alarms fire in the same order and
+ * print the same output as they would in real time -- just without
+ * the waiting. At end of input the horizon is lifted and pending
+ * alarms are run out until alarm_finite, the number of one-shot and
+ * counted alarms, drops to 0; the ones left then would repeat
+ * forever. All of these are protected by alarm_mutex.
+ */
+int virtual_clock = 0;
+int alarm_finite = 0;
+time_t virtual_now;
+time_t virtual_horizon;
+int input_done = 0;
+int clock_blocked = 0;  /* alarm thread can't advance the clock */
+pthread_cond_t clock_cond = PTHREAD_COND_INITIALIZER;
+
+time_t clock_now (void)
+{
+    return virtual_clock ? virtual_now : time (NULL);
+}
+
+/*
+ * Virtual clock only. The alarm thread can't move the clock any
+ * further until main reads more input: advance to the horizon, tell
+ * main, and wait for a new alarm or a new horizon.
+ */
+void clock_block (void)
+{
+    int status;
+
+    if (!input_done && virtual_now < virtual_horizon)
+        virtual_now = virtual_horizon;
+    clock_blocked = 1;
+    status = pthread_cond_signal (&clock_cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+    status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Wait on cond");
+}
+
+/*
+ * Let the clock run up to "horizon" (or to the last alarm, if
+ * input_done is set) and wait until it has. Called by main with
+ * alarm_mutex locked.
+ */
+void clock_advance (time_t horizon)
+{
+    int status;
+
+    if (horizon > virtual_horizon)
+        virtual_horizon = horizon;
+    clock_blocked = 0;
+    status = pthread_cond_signal (&alarm_cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+    while (!clock_blocked) {
+        status = pthread_cond_wait (&clock_cond, &alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on cond");
+    }
+}
+
+/*
+ * The hash bucket for an alarm number. number_buckets is a power
+ * of two.
+ */
+alarm_t **number_bucket (int number)
+{
+    return &number_hash[((unsigned)number * 2654435761u)
+        & (number_buckets - 1)];
+}
+
+/*
+ * Return the pending alarm with a number, or NULL if there is none.
+ */
+alarm_t *number_find (int number)
+{
+    alarm_t *alarm;
+
+    if (number_buckets == 0)
+        return NULL;
+    for (alarm = *number_bucket (number); alarm != NULL;
+            alarm = alarm->number_link)
+        if (alarm->number == number)
+            break;
+    return alarm;
+}
+
+/*
+ * Give a new alarm the next number and enter it in the table,
+ * doubling the table first if it is as full as it has buckets.
+ */
+void number_add (alarm_t *alarm)
+{
+    alarm_t **old, *entry, *next, **bucket;
+    int old_buckets, index;
+
+    if (number_pending >= number_buckets) {
+        old = number_hash;
+        old_buckets = number_buckets;
+        number_buckets = old_buckets == 0 ? 64 : old_buckets * 2;
+        number_hash = (alarm_t**)calloc (number_buckets, sizeof (alarm_t*));
+        if (number_hash == NULL)
+            errno_abort ("Allocate number hash");
+        for (index = 0; index < old_buckets; index++)
+            for (entry = old[index]; entry != NULL; entry = next) {
+                next = entry->number_link;
+                bucket = number_bucket (entry->number);
+                entry->number_link = *bucket;
+                *bucket = entry;
+            }
+        free (old);
+    }
+    alarm->number = ++alarm_numbered;
+    bucket = number_bucket (alarm->number);
+    alarm->number_link = *bucket;
+    *bucket = alarm;
+    number_pending++;
+}
+
+/*
+ * Take an alarm that is about to be freed out of the table.
+ */
+void number_remove (alarm_t *alarm)
+{
+    alarm_t **last;
+
+    for (last = number_bucket (alarm->number); *last != alarm;
+            last = &(*last)->number_link)
+        ;
+    *last = alarm->number_link;
+    number_pending--;
+}
+
+/*
+ * Put an alarm at a heap index.
+ */
+void heap_place (alarm_t *alarm, int slot)
+{
+    alarm_heap[slot] = alarm;
+    alarm->slot = slot;
+}
+
+/*
+ * Move the alarm at a heap index up or down until the heap is in
+ * order again, after it was put there or its time changed.
+ */
+void heap_fix (int slot)
+{
+    alarm_t *alarm;
+    int parent, child;
+
+    alarm = alarm_heap[slot];
+    while (slot > 0) {
+        parent = (slot - 1) / 2;
+        if (!ALARM_BEFORE (alarm, alarm_heap[parent]))
+            break;
+        heap_place (alarm_heap[parent], slot);
+        slot = parent;
+    }
+    while ((child = 2 * slot + 1) < alarm_count) {
+        if (child + 1 < alarm_count
+            && ALARM_BEFORE (alarm_heap[child + 1], alarm_heap[child]))
+            child++;
+        if (!ALARM_BEFORE (alarm_heap[child], alarm))
+            break;
+        heap_place (alarm_heap[child], slot);
+        slot = child;
+    }
+    heap_place (alarm, slot);
+}
+
+/*
+ * Add an alarm to the heap.
+ */
+void heap_push (alarm_t *alarm)
+{
+    if (alarm_count == alarm_size) {
+        alarm_size = alarm_size == 0 ? 64 : alarm_size * 2;
+        alarm_heap = (alarm_t**)realloc (
+            alarm_heap, alarm_size * sizeof (alarm_t*));
+        if (alarm_heap == NULL)
+            errno_abort ("Allocate alarm heap");
+    }
+    heap_place (alarm, alarm_count++);
+    heap_fix (alarm->slot);
+}
+
+/*
+ * Remove and return the earliest alarm in the heap.
+ */
+alarm_t *heap_pop (void)
+{
+    alarm_t *alarm;
+
+    alarm = alarm_heap[0];
+    alarm->slot = SLOT_OFF;
+    if (--alarm_count > 0) {
+        heap_place (alarm_heap[alarm_count], 0);
+        heap_fix (0);
+    }
+    return alarm;
+}
+
+/*
+ * The hash bucket for an interval. repeat_buckets is a power of two.
+ */
+repeat_t **repeat_bucket (int interval)
+{
+    return &repeat_hash[((unsigned)interval * 2654435761u)
+        & (repeat_buckets - 1)];
+}
+
+/*
+ * Return the recurring list for an interval, or NULL if there is
+ * none.
+ */
+repeat_t *repeat_find (int interval)
+{
+    repeat_t *repeat;
+
+    if (repeat_buckets == 0)
+        return NULL;
+    for (repeat = *repeat_bucket (interval); repeat != NULL;
+            repeat = repeat->link)
+        if (repeat->interval == interval)
+            break;
+    return repeat;
+}
+
+/*
+ * Create an empty recurring list for an interval, doubling the hash
+ * table first if it is as full as it has buckets.
+ */
+repeat_t *repeat_create (int interval)
+{
+    repeat_t *repeat, **old, *next, **bucket;
+    int old_buckets, index;
+
+    if (repeat_lists >= repeat_buckets) {
+        old = repeat_hash;
+        old_buckets = repeat_buckets;
+        repeat_buckets = old_buckets == 0 ? 64 : old_buckets * 2;
+        repeat_hash = (repeat_t**)calloc (
+            repeat_buckets, sizeof (repeat_t*));
+        if (repeat_hash == NULL)
+            errno_abort ("Allocate repeat hash");
+        for (index = 0; index < old_buckets; index++)
+            for (repeat = old[index]; repeat != NULL; repeat = next) {
+                next = repeat->link;
+                bucket = repeat_bucket (repeat->interval);
+                repeat->link = *bucket;
+                *bucket = repeat;
+            }
+        free (old);
+    }
+    repeat = (repeat_t*)malloc (sizeof (repeat_t));
+    if (repeat == NULL)
+        errno_abort ("Allocate repeat list");
+    repeat->interval = interval;
+    repeat->alarms = 0;
+    repeat->head = NULL;
+    repeat->tail = NULL;
+    bucket = repeat_bucket (interval);
+    repeat->link = *bucket;
+    *bucket = repeat;
+    repeat_lists++;
+    return repeat;
+}
+
+/*
+ * Unhash and free a recurring list that no alarm uses.
+ */
+void repeat_free (repeat_t *repeat)
+{
+    repeat_t **last;
+
+    for (last = repeat_bucket (repeat->interval); *last != repeat;
+            last = &(*last)->link)
+        ;
+    *last = repeat->link;
+    repeat_lists--;
+    free (repeat);
+}
+
+/*
+ * Count a new recurring alarm against the list for its interval,
+ * creating the list if there is none.
+ */
+void repeat_attach (alarm_t *alarm)
+{
+    repeat_t *repeat;
+
+    repeat = repeat_find (alarm->interval);
+    if (repeat == NULL)
+        repeat = repeat_create (alarm->interval);
+    repeat->alarms++;
+}
+
+/*
+ * Stop counting a recurring alarm that is being freed, and free its
+ * list if it was the last alarm with that interval. The alarm must
+ * already be off the list.
+ */
+void repeat_detach (alarm_t *alarm)
+{
+    repeat_t *repeat;
+
+    repeat = repeat_find (alarm->interval);
+    if (--repeat->alarms == 0)
+        repeat_free (repeat);
+}
+
+/*
+ * Insert a recurring alarm on the tail of the list for its interval
+ * (see repeat_attach). Only a new head goes into the heap; an append
+ * takes constant time. An alarm that doesn't belong at the tail --
+ * one re-armed after firing late, or one being put back by the alarm
+ * thread -- goes into the heap on its own instead, so a list never
+ * has to be searched.
+ */
+void repeat_insert (alarm_t *alarm)
+{
+    repeat_t *repeat;
+
+    repeat = repeat_find (alarm->interval);
+    if (repeat->tail != NULL && repeat->tail->time > alarm->time) {
+        heap_push (alarm);
+        return;
+    }
+    alarm->link = NULL;
+    if (repeat->head == NULL) {
+        alarm->prev = NULL;
+        repeat->head = alarm;
+        repeat->tail = alarm;
+        heap_push (alarm);
+        return;
+    }
+    alarm->slot = SLOT_REPEAT;
+    alarm->prev = repeat->tail;
+    repeat->tail->link = alarm;
+    repeat->tail = alarm;
+}
+
+/*
+ * Take an alarm off its recurring list, if it is on one, in constant
+ * time apart from the heap. If it was the head, the next alarm on
+ * the list takes its place in the heap (the alarm itself is left
+ * wherever it is). A list left empty is kept for the next re-arm.
+ */
+void repeat_unlink (alarm_t *alarm)
+{
+    repeat_t *repeat;
+
+    if (alarm->interval == 0
+        || (repeat = repeat_find (alarm->interval)) == NULL)
+        return;
+    if (repeat->head == alarm) {
+        repeat->head = alarm->link;
+        if (repeat->head == NULL)
+            repeat->tail = NULL;
+        else {
+            repeat->head->prev = NULL;
+            heap_push (repeat->head);
+        }
+        return;
+    }
+    if (alarm->slot != SLOT_REPEAT)
+        return;
+    alarm->prev->link = alarm->link;
+    if (alarm->link == NULL)
+        repeat->tail = alarm->prev;
+    else
+        alarm->link->prev = alarm->prev;
+}
+
+/*
+ * Remove and return the alarm with the earliest expiration time.
+ * Returns NULL if nothing is pending.
+ */
+alarm_t *alarm_next (void)
+{
+    alarm_t *alarm;
+
+    if (alarm_count == 0)
+        return NULL;
+    alarm = heap_pop ();
+    repeat_unlink (alarm);
+    return alarm;
+}
+
+/*
+ * Return the earliest expiration time without removing anything,
+ * or 0 if nothing is pending.
+ */
+time_t alarm_earliest (void)
+{
+    return alarm_count == 0 ? 0 : alarm_heap[0]->time;
+}
+
+/*
+ * Re-arm a fired alarm if it recurs, or free it.
+ * The caller must hold alarm_mutex.
+ */
+void alarm_rearm (alarm_t *alarm)
+{
+    /*
+     * Re-arm a recurring alarm in place. The next deadline
+     * is measured from the one just missed, not from "now",
+     * so a late firing doesn't make the schedule drift.
+     */
+    if (alarm->interval > 0
+        && (alarm->count == 0 || --alarm->count > 0)) {
+        alarm->time += alarm->interval;
+        repeat_insert (alarm);
+    } else {
+        number_remove (alarm);
+        if (alarm->interval > 0)
+            repeat_detach (alarm);
+        alarm_finite--;
+        free (alarm);
+    }
+}
+
+/*
+ * Report an expired alarm, then re-arm or free it.
+ * The caller must hold alarm_mutex.
+ */
+void alarm_fire (alarm_t *alarm)
+{
+    printf ("(%d) %s\n", alarm->seconds, alarm->message);
+    alarm_rearm (alarm);
+}
 
 /*
  * Insert alarm entry on list, in order.
@@ -39,7 +556,9 @@ time_t current_alarm = 0;
 void alarm_insert (alarm_t *alarm)
 {
     int status;
-    alarm_t **last, *next;
+#ifdef DEBUG
+    int slot;
+#endif
 
     /*
      * LOCKING PROTOCOL:
@@ -47,33 +566,19 @@ void alarm_insert (alarm_t *alarm)
      * This routine requires that the caller have locked the
      * alarm_mutex!
      */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
-        if (next->time >= alarm->time) {
-            alarm->link = next;
-            *last = alarm;
-            break;
-        }
-        last = &next->link;
-        next = next->link;
-    }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL) {
-        *last = alarm;
-        alarm->link = NULL;
-    }
+    if (alarm->interval > 0)
+        repeat_insert (alarm);
+    else {
+        heap_push (alarm);
 #ifdef DEBUG
-    printf ("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf ("%d(%d)[\"%s\"] ", next->time,
-            next->time - time (NULL), next->message);
-    printf ("]\n");
+        printf ("[heap: ");
+        for (slot = 0; slot < alarm_count; slot++)
+            printf ("%d(%d)[\"%s\"] ", alarm_heap[slot]->time,
+                alarm_heap[slot]->time - time (NULL),
+                alarm_heap[slot]->message);
+        printf ("]\n");
 #endif
+    }
     /*
      * Wake the alarm thread if it is not busy (that is, if
      * current_alarm is 0, signifying that it's waiting for
@@ -88,6 +593,96 @@ void alarm_insert (alarm_t *alarm)
     }
 }
 
+/*
+ * Give a pending alarm a new deadline in O(log n): a one-shot alarm
+ * moves up or down the heap from its own slot; a recurring one is
+ * unlinked from the list for its interval and goes into the heap by
+ * itself, so a list's tail never holds a far-off snoozed alarm that
+ * re-arms would have to be placed in front of. The alarm thread is
+ * only woken if the deadline it is waiting for changes. Returns 0,
+ * or -1 if the alarm is being fired and can't be moved. The caller
+ * must hold alarm_mutex.
+ */
+int alarm_reschedule (alarm_t *alarm, time_t time)
+{
+    int status;
+
+    if (alarm->slot == SLOT_OFF && alarm != alarm_held)
+        return -1;
+    if (alarm->time == time)
+        return 0;
+    if (alarm == alarm_held) {
+        /*
+         * The alarm thread has this one in hand. It puts it back
+         * when it wakes and finds the time has changed.
+         */
+        alarm->time = time;
+        status = pthread_cond_signal (&alarm_cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+        return 0;
+    }
+    repeat_unlink (alarm);
+    alarm->time = time;
+    if (alarm->slot >= 0)
+        heap_fix (alarm->slot);
+    else
+        heap_push (alarm);
+    if (current_alarm == 0 || time < current_alarm) {
+        current_alarm = time;
+        status = pthread_cond_signal (&alarm_cond);
+        if (status != 0)
+            err_abort (status, "Signal cond");
+    }
+    return 0;
+}
+
+/*
+ * Fire an expired alarm together with every other alarm due by the
+ * same time. The whole batch is taken off the lists in one go, then
+ * reported with alarm_mutex released, so a large cohort coming due
+ * at once holds the mutex only for the list operations and main can
+ * keep inserting meanwhile. Nothing else touches an alarm once it is
+ * off the lists. Called by the alarm thread with alarm_mutex held;
+ * returns with it held.
+ */
+void alarm_drain (alarm_t *alarm)
+{
+    alarm_t *batch, **tail, *next;
+    time_t due;
+    int status;
+
+    due = clock_now ();
+    if (due < alarm->time)
+        due = alarm->time;
+    batch = alarm;
+    tail = &alarm->link;
+    while ((next = alarm_next ()) != NULL) {
+        if (next->time > due) {
+            alarm_insert (next);
+            break;
+        }
+        *tail = next;
+        tail = &next->link;
+    }
+    *tail = NULL;
+
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    for (next = batch; next != NULL; next = next->link)
+        printf ("(%d) %s\n", next->seconds, next->message);
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+
+    while (batch != NULL) {
+        next = batch->link;
+        alarm_rearm (batch);
+        batch = next;
+    }
+}
+
 /*
  * The alarm thread's start routine.
  */
@@ -114,16 +709,36 @@ void *alarm_thread (void *arg)
          * routine that the thread is not busy.
          */
         current_alarm = 0;
-        while (alarm_list == NULL) {
+        while ((alarm = alarm_next ()) == NULL) {
+            if (virtual_clock) {
+                clock_block ();
+                continue;
+            }
             status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
             if (status != 0)
                 err_abort (status, "Wait on cond");
             }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time (NULL);
+        now = clock_now ();
         expired = 0;
-        if (alarm->time > now) {
+        if (alarm->time > now && virtual_clock) {
+            /*
+             * Jump to the deadline -- unless main has input that
+             * arrives before it, in which case put the alarm back
+             * and let main catch up first. Once input is over,
+             * alarms that repeat forever don't move the clock on
+             * their own.
+             */
+            if (input_done ? alarm_finite > 0
+                : alarm->time <= virtual_horizon) {
+                virtual_now = alarm->time;
+                expired = 1;
+            } else {
+                current_alarm = alarm->time;
+                alarm_insert (alarm);
+                clock_block ();
+                continue;
+            }
+        } else if (alarm->time > now) {
 #ifdef DEBUG
             printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
                 alarm->time - time (NULL), alarm->message);
@@ -131,33 +746,377 @@ void *alarm_thread (void *arg)
             cond_time.tv_sec = alarm->time;
             cond_time.tv_nsec = 0;
             current_alarm = alarm->time;
-            while (current_alarm == alarm->time) {
+            alarm_held = alarm;
+            /*
+             * Stop waiting once an earlier alarm comes in, or once the
+             * held alarm itself is rescheduled -- even if an insert has
+             * meanwhile set current_alarm to its new time.
+             */
+            while (current_alarm == alarm->time
+                && alarm->time == cond_time.tv_sec) {
                 status = pthread_cond_timedwait (
                     &alarm_cond, &alarm_mutex, &cond_time);
                 if (status == ETIMEDOUT) {
-                    expired = 1;
+                    /* unless it was rescheduled meanwhile */
+                    expired = alarm->time == cond_time.tv_sec;
                     break;
                 }
                 if (status != 0)
                     err_abort (status, "Cond timedwait");
             }
+            alarm_held = NULL;
             if (!expired)
                 alarm_insert (alarm);
         } else
             expired = 1;
-        if (expired) {
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
+        if (expired)
+            alarm_drain (alarm);
+    }
+}
+
+/*
+ * Workload capture ("-r"). Only main writes to it.
+ */
+FILE *capture = NULL;
+struct timespec capture_start;
+
+/*
+ * Record an accepted command with the time it arrived.
+ */
+void capture_line (const char *line)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    fprintf (capture, "@%.6f %s", (now.tv_sec - capture_start.tv_sec)
+        + (now.tv_nsec - capture_start.tv_nsec) / 1e9, line);
+}
+
+/*
+ * Handle "Snooze <number> <seconds>" or "Reschedule <number>
+ * <seconds>". The caller must not hold alarm_mutex.
+ */
+void snooze_command (char *line)
+{
+    int status, number, seconds, snooze;
+    alarm_t *alarm;
+    time_t time;
+
+    snooze = line[0] == 'S';
+    if (sscanf (line, snooze ? "Snooze %d %d" : "Reschedule %d %d",
+            &number, &seconds) < 2 || seconds < 0) {
+        fprintf (stderr, "Bad command\n");
+        return;
+    }
+    status = pthread_mutex_lock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    alarm = number_find (number);
+    if (alarm == NULL)
+        fprintf (stderr, "No alarm %d\n", number);
+    else {
+        time = snooze ? alarm->time + seconds : clock_now () + seconds;
+        if (alarm_reschedule (alarm, time) != 0)
+            fprintf (stderr, "Alarm %d is being fired\n", number);
+        else if (capture != NULL)
+            capture_line (line);
+    }
+    status = pthread_mutex_unlock (&alarm_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+/*
+ * Parse one command line and, if it is good, insert the alarm.
+ * The caller must not hold alarm_mutex.
+ */
+void alarm_command (char *line)
+{
+    int status;
+    alarm_t *alarm;
+
+    if (strlen (line) <= 1)
+        return;
+    if (strncmp (line, "Snooze ", 7) == 0
+        || strncmp (line, "Reschedule ", 11) == 0) {
+        snooze_command (line);
+        return;
+    }
+    alarm = (alarm_t*)malloc (sizeof (alarm_t));
+    if (alarm == NULL)
+        errno_abort ("Allocate alarm");
+
+    /*
+     * Parse input line into seconds (%d) and a message
+     * (%64[^\n]), consisting of up to 64 characters
+     * separated from the seconds by whitespace. A recurring
+     * alarm gives its interval, and optionally a count, after
+     * the word "Repeat".
+     */
+    alarm->interval = 0;
+    alarm->count = 0;
+    if (strncmp (line, "Repeat ", 7) == 0) {
+        if (sscanf (line, "Repeat %d x%d %64[^\n]",
+                &alarm->interval, &alarm->count, alarm->message) == 3) {
+            if (alarm->count <= 0)
+                alarm->interval = -1;
+        } else {
+            alarm->count = 0;
+            if (sscanf (line, "Repeat %d %64[^\n]",
+                    &alarm->interval, alarm->message) < 2)
+                alarm->interval = -1;
+        }
+        if (alarm->interval <= 0)
+            alarm->interval = -1;
+        alarm->seconds = alarm->interval;
+    } else if (sscanf (line, "%d %64[^\n]",
+        &alarm->seconds, alarm->message) < 2)
+        alarm->interval = -1;
+    if (alarm->interval < 0) {
+        fprintf (stderr, "Bad command\n");
+        free (alarm);
+    } else {
+        if (capture != NULL)
+            capture_line (line);
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        alarm->time = clock_now () + alarm->seconds;
+        /*
+         * Number the new alarm and insert it into the heap
+         * (or its repeat list).
+         */
+        number_add (alarm);
+        if (alarm->interval == 0 || alarm->count > 0)
+            alarm_finite++;
+        if (alarm->interval > 0)
+            repeat_attach (alarm);
+        alarm_insert (alarm);
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * If the line starts with an "@<seconds>" stamp, remove it and set
+ * *arrival to that many seconds after "start". Returns 1 if the line
+ * had a stamp. A fraction of a second is accepted, but dropped.
+ */
+int line_stamp (char *line, time_t start, time_t *arrival)
+{
+    double seconds;
+    int offset;
+
+    if (line[0] != '@' || sscanf (line, "@%lf%n", &seconds, &offset) != 1)
+        return 0;
+    *arrival = start + (time_t)seconds;
+    while (line[offset] == ' ' || line[offset] == '\t')
+        offset++;
+    memmove (line, line + offset, strlen (line + offset) + 1);
+    return 1;
+}
+
+/*
+ * Arm (or, with a deadline of 0, disarm) a timerfd for an absolute
+ * time on the real-time clock.
+ */
+void timer_arm (int fd, time_t deadline)
+{
+    struct itimerspec spec;
+
+    memset (&spec, 0, sizeof (spec));
+    spec.it_value.tv_sec = deadline;
+    if (timerfd_settime (fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        errno_abort ("Arm timer");
+}
+
+/*
+ * The event-loop backend, used with "-e". Instead of an alarm thread
+ * waiting on alarm_cond, main waits in epoll on standard input and
+ * on a timerfd armed for the earliest deadline, so commands and
+ * expirations are handled by one thread with no condition variable
+ * handoffs. A second timerfd holds input back until the arrival time
+ * of an "@" stamped line. Regular files can't be watched by epoll,
+ * but are always readable, so redirected input is simply read
+ * whenever it isn't being held back. Never returns.
+ */
+void event_loop (time_t start)
+{
+    struct epoll_event event, events[3];
+    struct timespec now;
+    char buffer[65536], line[128], *end;
+    size_t used, first, len;
+    uint64_t ticks;
+    int epoll_fd, alarm_fd, input_fd, count, i, status;
+    int paused, watching, eof, input_file, ready;
+    time_t arrival, armed, earliest;
+    alarm_t *alarm;
+
+    epoll_fd = epoll_create1 (0);
+    alarm_fd = timerfd_create (CLOCK_REALTIME, 0);
+    input_fd = timerfd_create (CLOCK_REALTIME, 0);
+    if (epoll_fd == -1 || alarm_fd == -1 || input_fd == -1)
+        errno_abort ("Create event loop");
+    event.events = EPOLLIN;
+    event.data.fd = STDIN_FILENO;
+    input_file = 0;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
+        if (errno != EPERM)
+            errno_abort ("Watch input");
+        input_file = 1;
+    }
+    event.data.fd = alarm_fd;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, alarm_fd, &event) == -1)
+        errno_abort ("Watch alarm timer");
+    event.data.fd = input_fd;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, input_fd, &event) == -1)
+        errno_abort ("Watch input timer");
+
+    used = 0;
+    paused = 0;
+    watching = 1;
+    eof = 0;
+    armed = 0;
+    printf ("Alarm> ");
+    fflush (stdout);
+    while (1) {
+        ready = input_file && !paused && !eof;
+        count = epoll_wait (epoll_fd, events, 3, ready ? 0 : -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Wait for events");
+        }
+        for (i = 0; i < count; i++) {
+            if (events[i].data.fd == STDIN_FILENO)
+                ready = 1;
+            else if (events[i].data.fd == input_fd) {
+                read (input_fd, &ticks, sizeof (ticks));
+                paused = 0;
+            } else {
+                /*
+                 * Expire everything that is due. Use the clock the
+                 * timer was armed on, since time() can lag it.
+                 */
+                read (alarm_fd, &ticks, sizeof (ticks));
+                armed = 0;
+                clock_gettime (CLOCK_REALTIME, &now);
+                status = pthread_mutex_lock (&alarm_mutex);
+                if (status != 0)
+                    err_abort (status, "Lock mutex");
+                while ((alarm = alarm_next ()) != NULL) {
+                    if (alarm->time > now.tv_sec) {
+                        alarm_insert (alarm);
+                        break;
+                    }
+                    alarm_fire (alarm);
+                }
+                status = pthread_mutex_unlock (&alarm_mutex);
+                if (status != 0)
+                    err_abort (status, "Unlock mutex");
+            }
+        }
+        if (ready) {
+            len = read (STDIN_FILENO, buffer + used, sizeof (buffer) - used);
+            if (len == (size_t)-1)
+                errno_abort ("Read input");
+            if (len == 0) {
+                eof = 1;
+                if (!input_file)
+                    epoll_ctl (epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            }
+            used += len;
+        }
+
+        /*
+         * Run every complete line that has arrived, stopping at one
+         * whose "@" stamp is still in the future.
+         */
+        first = 0;
+        while (!paused
+            && (end = memchr (buffer + first, '\n', used - first)) != NULL) {
+            len = end - (buffer + first) + 1;
+            if (len >= sizeof (line)) {
+                memcpy (line, buffer + first, sizeof (line) - 2);
+                strcpy (line + sizeof (line) - 2, "\n");
+            } else {
+                memcpy (line, buffer + first, len);
+                line[len] = '\0';
+            }
+            if (line_stamp (line, start, &arrival) && arrival > time (NULL)) {
+                timer_arm (input_fd, arrival);
+                paused = 1;
+                break;
+            }
+            first += len;
+            alarm_command (line);
+            printf ("Alarm> ");
+        }
+        memmove (buffer, buffer + first, used - first);
+        used -= first;
+        if (used == sizeof (buffer)) {
+            fprintf (stderr, "Bad command\n");
+            used = 0;
+        }
+        fflush (stdout);
+
+        /* stop reading while input is held back, or the loop spins */
+        if (eof) {
+            if (!paused && memchr (buffer, '\n', used) == NULL)
+                exit (0);
+        } else if (!input_file && watching == paused) {
+            watching = !paused;
+            event.events = watching ? EPOLLIN : 0;
+            event.data.fd = STDIN_FILENO;
+            epoll_ctl (epoll_fd, EPOLL_CTL_MOD, STDIN_FILENO, &event);
+        }
+
+        /* only touch the timer when the earliest deadline moved */
+        status = pthread_mutex_lock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Lock mutex");
+        earliest = alarm_earliest ();
+        status = pthread_mutex_unlock (&alarm_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock mutex");
+        if (earliest != armed) {
+            timer_arm (alarm_fd, earliest);
+            armed = earliest;
         }
     }
 }
 
 int main (int argc, char *argv[])
 {
-    int status;
+    int status, arg, event_mode = 0;
     char line[128];
-    alarm_t *alarm;
     pthread_t thread;
+    time_t start, arrival;
+    struct timespec wall_start, wall_end;
+
+    start = time (NULL);
+    clock_gettime (CLOCK_MONOTONIC, &capture_start);
+    for (arg = 1; arg < argc; arg++) {
+        if (strcmp (argv[arg], "-e") == 0)
+            event_mode = 1;
+        else if (strcmp (argv[arg], "-v") == 0)
+            virtual_clock = 1;
+        else if (strcmp (argv[arg], "-r") == 0 && arg + 1 < argc) {
+            capture = fopen (argv[++arg], "w");
+            if (capture == NULL)
+                errno_abort ("Open capture file");
+        } else
+            break;
+    }
+    if (arg < argc || (event_mode && virtual_clock)) {
+        fprintf (stderr, "Usage: %s [-e | -v] [-r capture]\n", argv[0]);
+        exit (1);
+    }
+    if (event_mode)
+        event_loop (start);
+    virtual_now = virtual_horizon = start;
+    clock_gettime (CLOCK_MONOTONIC, &wall_start);
 
     status = pthread_create (
         &thread, NULL, alarm_thread, NULL);
@@ -165,34 +1124,44 @@ int main (int argc, char *argv[])
         err_abort (status, "Create alarm thread");
     while (1) {
         printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
-        if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+            if (virtual_clock) {
+                /*
+                 * Run out whatever is still pending, then report
+                 * how much time was simulated and how long it took.
+                 */
+                status = pthread_mutex_lock (&alarm_mutex);
+                if (status != 0)
+                    err_abort (status, "Lock mutex");
+                input_done = 1;
+                clock_advance (virtual_now);
+                clock_gettime (CLOCK_MONOTONIC, &wall_end);
+                fprintf (stderr, "Simulated %ld seconds in %.3f seconds\n",
+                    (long)(virtual_now - start),
+                    (wall_end.tv_sec - wall_start.tv_sec)
+                    + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9);
+            }
+            exit (0);
+        }
 
         /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
+         * An "@<seconds>" stamp holds the rest of the line back
+         * until that many seconds after startup: on the virtual
+         * clock by letting the clock run up to it, otherwise by
+         * sleeping.
          */
-        if (sscanf (line, "%d %64[^\n]", 
-            &alarm->seconds, alarm->message) < 2) {
-            fprintf (stderr, "Bad command\n");
-            free (alarm);
-        } else {
-            status = pthread_mutex_lock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
-            alarm->time = time (NULL) + alarm->seconds;
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
-             */
-            alarm_insert (alarm);
-            status = pthread_mutex_unlock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+        if (line_stamp (line, start, &arrival)) {
+            if (virtual_clock) {
+                status = pthread_mutex_lock (&alarm_mutex);
+                if (status != 0)
+                    err_abort (status, "Lock mutex");
+                clock_advance (arrival);
+                status = pthread_mutex_unlock (&alarm_mutex);
+                if (status != 0)
+                    err_abort (status, "Unlock mutex");
+            } else if (arrival > time (NULL))
+                sleep (arrival - time (NULL));
         }
+        alarm_command (line);
     }
 }
@@ -0,0 +1,547 @@
+/*
+ * alarm_engine.c
+ *
+ * alarm_cond.c, New_Alarm_Cond.c and My_Alarm.c are three hand
+ * written variants of one engine: a main thread that queues alarms
+ * and an alarm thread that waits for the earliest one and reports
+ * it. This is that engine once, with the parts they differ in
+ * chosen at compile time:
+ *
+ *   QUEUE  QUEUE_LIST   list sorted by deadline (alarm_cond.c)
+ *          QUEUE_SCAN   unsorted list, searched for the earliest
+ *                       deadline each time (New_Alarm_Cond.c)
+ *          QUEUE_HEAP   binary heap on deadline
+ *   LOCK   LOCK_COND    mutex and condition variable (alarm_cond.c)
+ *          LOCK_SEM     semaphores (New_Alarm_Cond.c)
+ *          LOCK_SPIN    spin lock, polling with sched_yield
+ *                       (My_Alarm.c)
+ *   CLOCK  CLOCK_REAL   monotonic clock, to the nanosecond
+ *          CLOCK_VIRTUAL  jump straight to the next deadline, once
+ *                       main has queued everything (as alarm_cond.c
+ *                       "-v" does at end of input); lateness is then
+ *                       0 by construction, and only the time taken
+ *                       means anything
+ *   SINK   SINK_PRINT   print "(<seconds>) <message>"
+ *          SINK_COUNT   only count
+ *
+ * e.g. cc -DQUEUE=QUEUE_HEAP -DLOCK=LOCK_SEM alarm_engine.c. Each
+ * policy is a set of static functions picked by the preprocessor,
+ * so the compiler sees straight-line calls it can inline; nothing
+ * is chosen at run time. "make bench" builds and runs every
+ * combination.
+ *
+ * Without arguments it reads "<seconds> <message>" lines like
+ * alarm_cond.c. "-b <count> [<window ms>]" instead queues <count>
+ * alarms due at random times within the window, waits for them all
+ * to fire, and prints one line of results.
+ */
+#define _GNU_SOURCE         /* sem_clockwait */
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "errors.h"
+
+#define QUEUE_LIST      1
+#define QUEUE_SCAN      2
+#define QUEUE_HEAP      3
+#define LOCK_COND       1
+#define LOCK_SEM        2
+#define LOCK_SPIN       3
+#define CLOCK_REAL      1
+#define CLOCK_VIRTUAL   2
+#define SINK_PRINT      1
+#define SINK_COUNT      2
+
+#ifndef QUEUE
+# define QUEUE QUEUE_LIST
+#endif
+#ifndef LOCK
+# define LOCK LOCK_COND
+#endif
+#ifndef CLOCK
+# define CLOCK CLOCK_REAL
+#endif
+#ifndef SINK
+# define SINK SINK_PRINT
+#endif
+
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    int64_t             deadline;   /* ns on the engine clock */
+    int                 seconds;
+    char                message[64];
+} alarm_t;
+
+/*
+ * Queue policy. The caller holds the engine lock.
+ */
+#if QUEUE == QUEUE_LIST
+# define QUEUE_NAME "list"
+alarm_t *queue_head = NULL;
+
+static inline void queue_push (alarm_t *alarm)
+{
+    alarm_t **last = &queue_head;
+
+    while (*last != NULL && (*last)->deadline <= alarm->deadline)
+        last = &(*last)->link;
+    alarm->link = *last;
+    *last = alarm;
+}
+
+static inline alarm_t *queue_peek (void)
+{
+    return queue_head;
+}
+
+static inline void queue_pop (void)
+{
+    queue_head = queue_head->link;
+}
+#elif QUEUE == QUEUE_SCAN
+# define QUEUE_NAME "scan"
+alarm_t *queue_head = NULL;
+alarm_t **queue_min = NULL;         /* link that points to the earliest */
+
+static inline void queue_push (alarm_t *alarm)
+{
+    alarm->link = queue_head;
+    queue_head = alarm;
+    queue_min = NULL;
+}
+
+static inline alarm_t *queue_peek (void)
+{
+    alarm_t **last;
+
+    if (queue_head == NULL)
+        return NULL;
+    if (queue_min == NULL) {
+        queue_min = &queue_head;
+        for (last = &queue_head->link; *last != NULL; last = &(*last)->link)
+            if ((*last)->deadline < (*queue_min)->deadline)
+                queue_min = last;
+    }
+    return *queue_min;
+}
+
+static inline void queue_pop (void)
+{
+    *queue_min = (*queue_min)->link;
+    queue_min = NULL;
+}
+#elif QUEUE == QUEUE_HEAP
+# define QUEUE_NAME "heap"
+alarm_t **queue_heap = NULL;
+int queue_count = 0, queue_size = 0;
+
+static inline void queue_push (alarm_t *alarm)
+{
+    int child, parent;
+
+    if (queue_count == queue_size) {
+        queue_size = queue_size == 0 ? 1024 : queue_size * 2;
+        queue_heap = (alarm_t**)realloc (queue_heap, queue_size * sizeof (alarm_t*));
+        if (queue_heap == NULL)
+            errno_abort ("Allocate heap");
+    }
+    for (child = queue_count++; child > 0; child = parent) {
+        parent = (child - 1) / 2;
+        if (queue_heap[parent]->deadline <= alarm->deadline)
+            break;
+        queue_heap[child] = queue_heap[parent];
+    }
+    queue_heap[child] = alarm;
+}
+
+static inline alarm_t *queue_peek (void)
+{
+    return queue_count == 0 ? NULL : queue_heap[0];
+}
+
+static inline void queue_pop (void)
+{
+    alarm_t *last;
+    int parent, child;
+
+    last = queue_heap[--queue_count];
+    for (parent = 0; (child = 2 * parent + 1) < queue_count; parent = child) {
+        if (child + 1 < queue_count
+            && queue_heap[child + 1]->deadline < queue_heap[child]->deadline)
+            child++;
+        if (last->deadline <= queue_heap[child]->deadline)
+            break;
+        queue_heap[parent] = queue_heap[child];
+    }
+    queue_heap[parent] = last;
+}
+#else
+# error "QUEUE must be QUEUE_LIST, QUEUE_SCAN or QUEUE_HEAP"
+#endif
+
+/*
+ * Clock policy.
+ */
+#if CLOCK == CLOCK_REAL
+# define CLOCK_NAME "real"
+static inline int64_t clock_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#elif CLOCK == CLOCK_VIRTUAL
+# define CLOCK_NAME "virtual"
+_Atomic int64_t virtual_now = 0;
+int virtual_hold = 1;               /* main is still queueing */
+
+static inline int64_t clock_ns (void)
+{
+    return atomic_load_explicit (&virtual_now, memory_order_relaxed);
+}
+#else
+# error "CLOCK must be CLOCK_REAL or CLOCK_VIRTUAL"
+#endif
+
+/*
+ * Lock policy: mutual exclusion, plus a way for the alarm thread to
+ * sleep until a deadline (or, with deadline 0, indefinitely) unless
+ * main signals that the earliest deadline changed. lock_wait
+ * releases the lock while it sleeps and holds it again on return.
+ */
+#if LOCK == LOCK_COND
+# define LOCK_NAME "cond"
+pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t engine_cond;
+
+static inline void lock_init (void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&engine_cond, &attr);
+    pthread_condattr_destroy (&attr);
+}
+
+static inline void lock_acquire (void)
+{
+    int status = pthread_mutex_lock (&engine_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+}
+
+static inline void lock_release (void)
+{
+    int status = pthread_mutex_unlock (&engine_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+static inline void lock_signal (void)
+{
+    pthread_cond_signal (&engine_cond);
+}
+
+static inline void lock_wait (int64_t deadline)
+{
+    struct timespec ts;
+    int status;
+
+    if (deadline == 0)
+        status = pthread_cond_wait (&engine_cond, &engine_mutex);
+    else {
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        status = pthread_cond_timedwait (&engine_cond, &engine_mutex, &ts);
+        if (status == ETIMEDOUT)
+            status = 0;
+    }
+    if (status != 0)
+        err_abort (status, "Wait on cond");
+}
+#elif LOCK == LOCK_SEM
+# define LOCK_NAME "sem"
+sem_t engine_sem;                   /* binary, for mutual exclusion */
+sem_t engine_wake;
+int engine_waiting = 0;             /* alarm thread is asleep */
+
+static inline void lock_init (void)
+{
+    sem_init (&engine_sem, 0, 1);
+    sem_init (&engine_wake, 0, 0);
+}
+
+static inline void lock_acquire (void)
+{
+    while (sem_wait (&engine_sem) != 0)
+        if (errno != EINTR)
+            errno_abort ("Lock semaphore");
+}
+
+static inline void lock_release (void)
+{
+    sem_post (&engine_sem);
+}
+
+static inline void lock_signal (void)
+{
+    if (engine_waiting) {
+        engine_waiting = 0;
+        sem_post (&engine_wake);
+    }
+}
+
+static inline void lock_wait (int64_t deadline)
+{
+    struct timespec ts;
+
+    engine_waiting = 1;
+    lock_release ();
+    if (deadline == 0)
+        while (sem_wait (&engine_wake) != 0 && errno == EINTR)
+            ;
+    else {
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        while (sem_clockwait (&engine_wake, CLOCK_MONOTONIC, &ts) != 0
+            && errno == EINTR)
+            ;
+    }
+    lock_acquire ();
+    /* a signal that raced with the timeout is simply absorbed */
+    if (!engine_waiting)
+        while (sem_trywait (&engine_wake) == 0)
+            ;
+    engine_waiting = 0;
+}
+#elif LOCK == LOCK_SPIN
+# define LOCK_NAME "spin"
+atomic_flag engine_spin = ATOMIC_FLAG_INIT;
+atomic_int engine_kick = 0;
+
+static inline void lock_init (void)
+{
+}
+
+static inline void lock_acquire (void)
+{
+    while (atomic_flag_test_and_set_explicit (&engine_spin, memory_order_acquire))
+        sched_yield ();
+}
+
+static inline void lock_release (void)
+{
+    atomic_flag_clear_explicit (&engine_spin, memory_order_release);
+}
+
+static inline void lock_signal (void)
+{
+    atomic_store_explicit (&engine_kick, 1, memory_order_release);
+}
+
+static inline void lock_wait (int64_t deadline)
+{
+    struct timespec ts;
+    int64_t now;
+
+    atomic_store_explicit (&engine_kick, 0, memory_order_relaxed);
+    lock_release ();
+    while (!atomic_load_explicit (&engine_kick, memory_order_acquire)) {
+        if (deadline != 0) {
+            clock_gettime (CLOCK_MONOTONIC, &ts);
+            now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            if (now >= deadline)
+                break;
+        }
+        sched_yield ();
+    }
+    lock_acquire ();
+}
+#else
+# error "LOCK must be LOCK_COND, LOCK_SEM or LOCK_SPIN"
+#endif
+
+/*
+ * Sink policy, called without the lock.
+ */
+unsigned long fired = 0;
+int64_t late_total = 0, late_max = 0;
+
+#if SINK == SINK_PRINT
+# define SINK_NAME "print"
+static inline void sink_fire (alarm_t *alarm)
+{
+    printf ("(%d) %s\n", alarm->seconds, alarm->message);
+}
+#elif SINK == SINK_COUNT
+# define SINK_NAME "count"
+static inline void sink_fire (alarm_t *alarm)
+{
+}
+#else
+# error "SINK must be SINK_PRINT or SINK_COUNT"
+#endif
+
+/*
+ * Sleep until the given deadline on the engine clock. A virtual
+ * clock just moves forward to it -- but not while main is still
+ * queueing, since it computes deadlines from the clock; until
+ * engine_release, wait for main instead.
+ */
+static inline void engine_wait (int64_t deadline)
+{
+#if CLOCK == CLOCK_VIRTUAL
+    if (deadline != 0 && !virtual_hold) {
+        atomic_store_explicit (&virtual_now, deadline, memory_order_relaxed);
+        return;
+    }
+    deadline = 0;
+#endif
+    lock_wait (deadline);
+}
+
+/*
+ * Main has queued everything: let a virtual clock move.
+ */
+static inline void engine_release (void)
+{
+#if CLOCK == CLOCK_VIRTUAL
+    lock_acquire ();
+    virtual_hold = 0;
+    lock_signal ();
+    lock_release ();
+#endif
+}
+
+/*
+ * Queue an alarm, waking the alarm thread if it is now the earliest.
+ */
+static inline void engine_insert (alarm_t *alarm)
+{
+    lock_acquire ();
+    queue_push (alarm);
+    if (queue_peek () == alarm)
+        lock_signal ();
+    lock_release ();
+}
+
+/*
+ * The alarm thread's start routine.
+ */
+void *alarm_thread (void *arg)
+{
+    alarm_t *alarm;
+    int64_t late;
+
+    lock_acquire ();
+    while (1) {
+        alarm = queue_peek ();
+        if (alarm == NULL) {
+            lock_wait (0);
+            continue;
+        }
+        if (alarm->deadline > clock_ns ()) {
+            engine_wait (alarm->deadline);
+            continue;
+        }
+        queue_pop ();
+        lock_release ();
+
+        late = clock_ns () - alarm->deadline;
+        sink_fire (alarm);
+        free (alarm);
+        /* only this thread writes the counters */
+        late_total += late;
+        if (late > late_max)
+            late_max = late;
+        __atomic_store_n (&fired, fired + 1, __ATOMIC_RELEASE);
+        lock_acquire ();
+    }
+}
+
+/*
+ * The benchmark: queue count alarms due within window_ms, at
+ * pseudo-random times (the same ones every run), and wait for them
+ * all to fire.
+ */
+void engine_bench (unsigned long count, long window_ms)
+{
+    alarm_t *alarm;
+    unsigned long i, seed = 12345;
+    struct timespec start, queued, done;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        alarm = (alarm_t*)malloc (sizeof (alarm_t));
+        if (alarm == NULL)
+            errno_abort ("Allocate alarm");
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        alarm->seconds = 0;
+        snprintf (alarm->message, sizeof (alarm->message), "bench %lu", i);
+        alarm->deadline = clock_ns ()
+            + (int64_t)((seed >> 33) % (window_ms * 1000 + 1)) * 1000;
+        engine_insert (alarm);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &queued);
+    engine_release ();
+    while (__atomic_load_n (&fired, __ATOMIC_ACQUIRE) < count)
+        sched_yield ();
+    clock_gettime (CLOCK_MONOTONIC, &done);
+
+    fprintf (stderr, "%-5s %-5s %-8s %-6s  %lu alarms  queued in %8.3f ms  all fired after %8.3f ms"
+        "  lateness mean %8.1f us  max %8.1f us\n",
+        QUEUE_NAME, LOCK_NAME, CLOCK_NAME, SINK_NAME, count,
+        (queued.tv_sec - start.tv_sec) * 1e3 + (queued.tv_nsec - start.tv_nsec) / 1e6,
+        (done.tv_sec - start.tv_sec) * 1e3 + (done.tv_nsec - start.tv_nsec) / 1e6,
+        late_total / 1e3 / count, late_max / 1e3);
+}
+
+int main (int argc, char *argv[])
+{
+    int status;
+    unsigned long accepted = 0;
+    char line[128];
+    alarm_t *alarm;
+    pthread_t thread;
+
+    lock_init ();
+    status = pthread_create (&thread, NULL, alarm_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create alarm thread");
+
+    if (argc > 2 && strcmp (argv[1], "-b") == 0) {
+        engine_bench (strtoul (argv[2], NULL, 0),
+            argc > 3 ? strtol (argv[3], NULL, 0) : 100);
+        exit (0);
+    }
+    while (1) {
+        printf ("Alarm> ");
+        if (fgets (line, sizeof (line), stdin) == NULL) {
+#if CLOCK == CLOCK_VIRTUAL
+            /* run out whatever is pending on the virtual clock */
+            engine_release ();
+            while (__atomic_load_n (&fired, __ATOMIC_ACQUIRE) < accepted)
+                sched_yield ();
+#endif
+            exit (0);
+        }
+        if (strlen (line) <= 1) continue;
+        alarm = (alarm_t*)malloc (sizeof (alarm_t));
+        if (alarm == NULL)
+            errno_abort ("Allocate alarm");
+        if (sscanf (line, "%d %63[^\n]",
+            &alarm->seconds, alarm->message) < 2 || alarm->seconds < 0) {
+            fprintf (stderr, "Bad command\n");
+            free (alarm);
+            continue;
+        }
+        alarm->deadline = clock_ns () + alarm->seconds * 1000000000LL;
+        engine_insert (alarm);
+        accepted++;
+    }
+}
@@ -0,0 +1,502 @@
+/*
+ * replay.c
+ *
+ * Replay a captured workload against one or more alarm engines and
+ * compare them.
+ *
+ *     replay.out [-x factor | -f] capture "engine command" ...
+ *
+ * The capture is what "alarm_cond.out -r file" or "assignment_3.out
+ * -r file" writes: one "@<seconds> <command>" line per accepted
+ * command, stamped with its arrival time after startup. Each engine
+ * command is run with "sh -c"; its standard input is fed the
+ * commands at their recorded times (or "factor" times faster with
+ * -x, or as fast as the engine takes them with -f), and every
+ * "(<seconds>) <message>" line it prints is matched to the command
+ * that asked for it. Snooze and Reschedule lines move the deadlines
+ * of the alarm they name, numbered in the order the alarms were
+ * accepted, as alarm_cond.c numbers them.
+ *
+ * For each engine the report gives the feed rate, and how late the
+ * alarms fired; the deadline of an alarm is taken to be the whole
+ * second the engine computes from time(), so only the engine's own
+ * delay counts. Later engines are also shown relative to the first.
+ */
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "errors.h"
+
+#define HASH_SIZE   4096
+#define LINE_SIZE   256
+
+/*
+ * A captured command and when it is due to be sent, in seconds
+ * after the start of the replay.
+ */
+typedef struct command_tag {
+    double              at;
+    char                line[LINE_SIZE];
+} command_t;
+
+/*
+ * One expected firing: its deadline, and the number of the alarm it
+ * belongs to.
+ */
+typedef struct due_tag {
+    double              due;
+    int                 number;
+} due_t;
+
+/*
+ * The alarms still expected, by the line the engine will print.
+ * Each entry keeps its deadlines in order, so identical alarms are
+ * matched first come, first served.
+ */
+typedef struct expect_tag {
+    struct expect_tag   *link;
+    char                *key;
+    due_t               *due;
+    int                 head, count, size;
+} expect_t;
+
+/*
+ * The results for one engine.
+ */
+typedef struct result_tag {
+    int                 sent;
+    double              feed;       /* seconds to send everything */
+    int                 expected;
+    int                 fired;
+    double              late_mean, late_p99, late_max; /* ms */
+} result_t;
+
+command_t *commands;
+int command_count;
+expect_t *expect_table[HASH_SIZE];
+double *late;                       /* seconds, one per match */
+int late_count, late_size;
+expect_t **numbered;                /* by alarm number, for Snooze */
+int numbered_count, numbered_size;
+
+double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned int hash (const char *key)
+{
+    unsigned int value = 2166136261u;
+
+    while (*key)
+        value = (value ^ (unsigned char)*key++) * 16777619u;
+    return value % HASH_SIZE;
+}
+
+expect_t *expect_find (const char *key, int create)
+{
+    expect_t **bucket, *expect;
+
+    bucket = &expect_table[hash (key)];
+    for (expect = *bucket; expect != NULL; expect = expect->link)
+        if (strcmp (expect->key, key) == 0)
+            return expect;
+    if (!create)
+        return NULL;
+    expect = (expect_t*)calloc (1, sizeof (expect_t));
+    if (expect == NULL || (expect->key = strdup (key)) == NULL)
+        errno_abort ("Allocate expectation");
+    expect->link = *bucket;
+    *bucket = expect;
+    return expect;
+}
+
+/*
+ * Expect a firing of alarm "number" at "due".
+ */
+expect_t *expect_add (const char *key, double due, int number)
+{
+    expect_t *expect;
+
+    expect = expect_find (key, 1);
+    if (expect->count == expect->size) {
+        /* slide the unmatched ones down before growing */
+        memmove (expect->due, expect->due + expect->head,
+            (expect->count - expect->head) * sizeof (due_t));
+        expect->count -= expect->head;
+        expect->head = 0;
+        if (expect->count == expect->size) {
+            expect->size = expect->size == 0 ? 4 : expect->size * 2;
+            expect->due = (due_t*)realloc (expect->due,
+                expect->size * sizeof (due_t));
+            if (expect->due == NULL)
+                errno_abort ("Allocate deadlines");
+        }
+    }
+    expect->due[expect->count].due = due;
+    expect->due[expect->count++].number = number;
+    return expect;
+}
+
+/*
+ * Give a new alarm the next number, remembering where its firings
+ * are expected.
+ */
+void expect_number (expect_t *expect)
+{
+    if (numbered_count + 1 >= numbered_size) {
+        numbered_size = numbered_size == 0 ? 1024 : numbered_size * 2;
+        numbered = (expect_t**)realloc (numbered,
+            numbered_size * sizeof (expect_t*));
+        if (numbered == NULL)
+            errno_abort ("Allocate alarm numbers");
+    }
+    numbered[++numbered_count] = expect;
+}
+
+int due_compare (const void *a, const void *b)
+{
+    double x = ((const due_t*)a)->due, y = ((const due_t*)b)->due;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Move the firings of alarm "number" that aren't due yet: by
+ * "seconds" for a Snooze, or so that the next one is "seconds" after
+ * "sent" for a Reschedule. Later firings of a recurring alarm move
+ * with the next one.
+ */
+void expect_snooze (int number, double sent, int seconds, int snooze)
+{
+    expect_t *expect;
+    double shift = 0;
+    int i, moved = 0;
+
+    if (number < 1 || number > numbered_count
+        || (expect = numbered[number]) == NULL)
+        return;
+    for (i = expect->head; i < expect->count; i++) {
+        if (expect->due[i].number != number || expect->due[i].due <= sent)
+            continue;
+        if (!moved)
+            shift = snooze ? seconds
+                : floor (sent) + seconds - expect->due[i].due;
+        expect->due[i].due += shift;
+        moved = 1;
+    }
+    if (moved)
+        qsort (expect->due + expect->head, expect->count - expect->head,
+            sizeof (due_t), due_compare);
+}
+
+void expect_clear (void)
+{
+    expect_t *expect, *next;
+    int bucket;
+
+    for (bucket = 0; bucket < HASH_SIZE; bucket++) {
+        for (expect = expect_table[bucket]; expect != NULL; expect = next) {
+            next = expect->link;
+            free (expect->key);
+            free (expect->due);
+            free (expect);
+        }
+        expect_table[bucket] = NULL;
+    }
+    numbered_count = 0;
+}
+
+/*
+ * Work out what a command will print, and when, from the time it was
+ * sent. Returns the number of alarms expected. A recurring alarm
+ * without a count is only followed for its first firing.
+ */
+int expect_command (const char *line, double sent)
+{
+    char key[LINE_SIZE + 16], message[LINE_SIZE];
+    int seconds, num, interval, count, i;
+    double base;
+    expect_t *expect = NULL;
+
+    base = floor (sent);
+    if (sscanf (line, "Snooze %d %d", &num, &seconds) == 2) {
+        expect_snooze (num, sent, seconds, 1);
+        return 0;
+    }
+    if (sscanf (line, "Reschedule %d %d", &num, &seconds) == 2) {
+        expect_snooze (num, sent, seconds, 0);
+        return 0;
+    }
+    if (sscanf (line, "Repeat %d x%d %255[^\n]", &interval, &count, message) == 3
+        || (sscanf (line, "Repeat %d %255[^\n]", &interval, message) == 2
+            && (count = 1, 1))) {
+        snprintf (key, sizeof (key), "(%d) %s", interval, message);
+        for (i = 1; i <= count; i++)
+            expect = expect_add (key, base + (double)interval * i,
+                numbered_count + 1);
+        expect_number (expect);
+        return count;
+    }
+    if (sscanf (line, "%d Message(%d) %255[^\n]", &seconds, &num, message) == 3
+        || sscanf (line, "%d %255[^\n]", &seconds, message) == 2) {
+        snprintf (key, sizeof (key), "(%d) %s", seconds, message);
+        expect_number (expect_add (key, base + seconds, numbered_count + 1));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Match one line of engine output.
+ */
+void expect_output (char *line, double when)
+{
+    expect_t *expect;
+
+    /* prompts are printed without a newline, so strip any in front */
+    while (strncmp (line, "Alarm> ", 7) == 0)
+        line += 7;
+    if (line[0] != '(')
+        return;
+    expect = expect_find (line, 0);
+    if (expect == NULL || expect->head == expect->count)
+        return;
+    if (late_count == late_size) {
+        late_size = late_size == 0 ? 1024 : late_size * 2;
+        late = (double*)realloc (late, late_size * sizeof (double));
+        if (late == NULL)
+            errno_abort ("Allocate lateness");
+    }
+    late[late_count++] = when - expect->due[expect->head++].due;
+}
+
+/*
+ * Read the capture file.
+ */
+void capture_load (const char *name)
+{
+    FILE *file;
+    char line[LINE_SIZE + 32];
+    int size = 0, offset;
+    double at;
+
+    file = fopen (name, "r");
+    if (file == NULL)
+        errno_abort ("Open capture");
+    while (fgets (line, sizeof (line), file) != NULL) {
+        if (sscanf (line, "@%lf %n", &at, &offset) != 1)
+            continue;
+        if (command_count == size) {
+            size = size == 0 ? 1024 : size * 2;
+            commands = (command_t*)realloc (commands, size * sizeof (command_t));
+            if (commands == NULL)
+                errno_abort ("Allocate commands");
+        }
+        commands[command_count].at = at;
+        snprintf (commands[command_count].line, LINE_SIZE, "%s", line + offset);
+        command_count++;
+    }
+    fclose (file);
+}
+
+int late_compare (const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Run one engine through the capture. speed is the replay factor,
+ * or 0 to send as fast as the engine reads.
+ */
+void replay (const char *engine, double speed, result_t *result)
+{
+    int to_engine[2], from_engine[2];
+    pid_t pid;
+    struct pollfd fds[2];
+    expect_t *expect;
+    char out[65536], in[65536], *line, *end;
+    size_t out_used = 0, out_sent = 0, in_used = 0;
+    double start, last_due, wait, when;
+    int next = 0, open_in = 1, timeout, count, i;
+    ssize_t len;
+
+    if (pipe (to_engine) == -1 || pipe (from_engine) == -1)
+        errno_abort ("Create pipes");
+    pid = fork ();
+    if (pid == -1)
+        errno_abort ("Fork engine");
+    if (pid == 0) {
+        dup2 (to_engine[0], 0);
+        dup2 (from_engine[1], 1);
+        close (to_engine[0]);
+        close (to_engine[1]);
+        close (from_engine[0]);
+        close (from_engine[1]);
+        /*
+         * The engines print with stdio, which fully buffers a pipe;
+         * line buffering makes each alarm visible when it fires.
+         */
+        execlp ("stdbuf", "stdbuf", "-oL", "sh", "-c", engine, (char*)NULL);
+        execl ("/bin/sh", "sh", "-c", engine, (char*)NULL);
+        errno_abort ("Run engine");
+    }
+    close (to_engine[0]);
+    close (from_engine[1]);
+    fcntl (to_engine[1], F_SETFL, O_NONBLOCK);
+
+    memset (result, 0, sizeof (*result));
+    late_count = 0;
+    last_due = 0;
+    start = now ();
+    while (1) {
+        /* queue every command that is due */
+        while (next < command_count
+            && (speed == 0 || commands[next].at / speed <= now () - start)
+            && out_used + LINE_SIZE < sizeof (out)) {
+            len = strlen (commands[next].line);
+            memcpy (out + out_used, commands[next].line, len);
+            out_used += len;
+            when = now ();
+            count = expect_command (commands[next].line, when);
+            result->expected += count;
+            next++;
+        }
+        if (next == command_count && out_sent == out_used && open_in) {
+            result->feed = now () - start;
+            result->sent = command_count;
+            open_in = 0;
+            /* leave the engine until everything should have fired */
+            last_due = now () + 2;
+            for (i = 0; i < HASH_SIZE; i++)
+                for (expect = expect_table[i]; expect != NULL; expect = expect->link)
+                    if (expect->count > 0 && expect->due[expect->count - 1].due + 2 > last_due)
+                        last_due = expect->due[expect->count - 1].due + 2;
+        }
+        if (!open_in && (result->fired == result->expected || now () > last_due))
+            break;
+
+        fds[0].fd = from_engine[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = to_engine[1];
+        fds[1].events = out_sent < out_used ? POLLOUT : 0;
+        if (next < command_count && speed != 0) {
+            wait = commands[next].at / speed - (now () - start);
+            timeout = wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+        } else if (next < command_count)
+            timeout = 0;
+        else
+            timeout = 100;
+        if (poll (fds, 2, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Poll engine");
+        }
+        if (fds[1].revents & (POLLOUT | POLLERR)) {
+            len = write (to_engine[1], out + out_sent, out_used - out_sent);
+            if (len > 0)
+                out_sent += len;
+            if (out_sent == out_used)
+                out_sent = out_used = 0;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            len = read (from_engine[0], in + in_used, sizeof (in) - in_used - 1);
+            if (len <= 0)
+                break;
+            in_used += len;
+            when = now ();
+            in[in_used] = '\0';
+            line = in;
+            while ((end = strchr (line, '\n')) != NULL) {
+                *end = '\0';
+                expect_output (line, when);
+                line = end + 1;
+            }
+            in_used -= line - in;
+            memmove (in, line, in_used);
+            if (in_used == sizeof (in) - 1)
+                in_used = 0;
+            result->fired = late_count;
+        }
+    }
+    close (to_engine[1]);
+    close (from_engine[0]);
+    kill (pid, SIGTERM);
+    waitpid (pid, NULL, 0);
+    if (result->sent == 0) {
+        result->sent = next;
+        result->feed = now () - start;
+    }
+
+    result->fired = late_count;
+    if (late_count > 0) {
+        qsort (late, late_count, sizeof (double), late_compare);
+        for (i = 0; i < late_count; i++)
+            result->late_mean += late[i];
+        result->late_mean = result->late_mean / late_count * 1000;
+        result->late_p99 = late[(late_count * 99 + 99) / 100 - 1] * 1000;
+        result->late_max = late[late_count - 1] * 1000;
+    }
+    expect_clear ();
+}
+
+/*
+ * Relative change, for the comparison with the first engine.
+ */
+double delta (double value, double base)
+{
+    return base == 0 ? 0 : (value - base) / base * 100;
+}
+
+int main (int argc, char *argv[])
+{
+    result_t *results;
+    double speed = 1;
+    int arg = 1, engines, i;
+
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp (argv[arg], "-x") == 0 && arg + 1 < argc)
+            speed = atof (argv[++arg]);
+        else if (strcmp (argv[arg], "-f") == 0)
+            speed = 0;
+        else
+            break;
+        arg++;
+    }
+    if (argc - arg < 2 || speed < 0) {
+        fprintf (stderr, "Usage: %s [-x factor | -f] capture \"engine command\" ...\n",
+            argv[0]);
+        exit (1);
+    }
+    signal (SIGPIPE, SIG_IGN);
+    capture_load (argv[arg++]);
+    engines = argc - arg;
+    results = (result_t*)calloc (engines, sizeof (result_t));
+    if (results == NULL)
+        errno_abort ("Allocate results");
+
+    for (i = 0; i < engines; i++) {
+        replay (argv[arg + i], speed, &results[i]);
+        printf ("%s\n", argv[arg + i]);
+        printf ("    sent %d commands in %.3f s (%.0f per second)\n",
+            results[i].sent, results[i].feed,
+            results[i].feed > 0 ? results[i].sent / results[i].feed : 0);
+        printf ("    fired %d of %d alarms, late by mean %.1f ms, p99 %.1f ms, max %.1f ms\n",
+            results[i].fired, results[i].expected,
+            results[i].late_mean, results[i].late_p99, results[i].late_max);
+        if (i > 0)
+            printf ("    vs first: feed rate %+.1f%%, mean lateness %+.1f ms, p99 %+.1f ms\n",
+                delta (results[0].feed, results[i].feed),
+                results[i].late_mean - results[0].late_mean,
+                results[i].late_p99 - results[0].late_p99);
+    }
+    return 0;
+}